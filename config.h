@@ -56,7 +56,8 @@ static const trace_baseline_t trace_baseline_table[] = {
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Default maximum heap size in bytes, used unless the MEM_MAX_HEAP
+ * environment variable or mdriver -H sets another at run time
  */
 #define MAX_HEAP (20 * (1 << 20)) /* 20 MB */
 
@@ -6,6 +6,11 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #include "config.h"
 #include "fsecs.h"
@@ -26,7 +31,7 @@
              */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p, a) ((((unsigned long)(p)) % (a)) == 0)
 
 /******************************
  * The key compound data types
@@ -41,9 +46,22 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    int index;                          /* index for free() to use later */
-    int size;                           /* byte size of alloc/realloc request */
+    enum {
+        ALLOC,
+        FREE,
+        REALLOC,
+        CALLOC,
+        MEMALIGN,
+        BATCH_ALLOC,
+        BATCH_FREE,
+        ARENA_ALLOC,
+        ARENA_RESET
+    } type;           /* type of request */
+    int index;        /* index for free() to use later */
+    size_t size;      /* byte size of alloc/realloc request */
+    size_t alignment; /* payload alignment the request asks for */
+    size_t count;     /* blocks a batch request takes, from index on */
+    int arena;        /* arena an arena request goes to */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -56,6 +74,9 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void **batch;        /* room for the pointers of one batch request */
+    int num_arenas;      /* number of arenas the trace uses */
+    mm_arena_t **arenas; /* the arenas, created afresh for every run */
 } trace_t;
 
 /*
@@ -83,6 +104,25 @@ typedef struct {
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only when per-op latency is measured (-L) */
+    double lat_p99; /* 99th percentile latency of one mm call, in ns */
+    double lat_max; /* worst latency of one mm call, in ns */
+
+    /* defined only for the student malloc package: the allocator's own
+     * counters after one run of the trace (shown with -v) */
+    mm_stats_t heap;
+
+    /* defined only for the student malloc package: heap plus mapped bytes
+     * at their highest and once the trace has finished (set by
+     * eval_mm_util) */
+    size_t peak_footprint;
+    size_t final_footprint;
+    /* how much of the final footprint is resident in physical memory */
+    size_t final_resident;
+    /* dTLB load and store misses in one run of the trace, or -1 if they
+     * could not be counted (shown with -v) */
+    long long dtlb_misses;
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -90,6 +130,7 @@ typedef struct {
  * Global variables
  *******************/
 int verbose = 0;         /* global flag for verbose output */
+static int latency = 0;  /* measure per-op latency as well (set by -L) */
 static int errors = 0;   /* number of errs found when running student malloc */
 char msg[MAXLINE + 100]; /* for whenever we need to compose an error message */
 
@@ -104,8 +145,8 @@ static char *default_tracefiles[] = {DEFAULT_TRACEFILES, NULL};
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, int tracenum,
-                     int opnum);
+static int add_range(range_t **ranges, char *lo, size_t size,
+                     size_t alignment, int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
@@ -122,11 +163,16 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void eval_mm_dtlb(speed_t *params, stats_t *stats);
 
 /* Various helper routines */
 static double compute_performance_index(int num_tracefiles, double secs,
                                         double ops, double util);
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printdtlb(int n, stats_t *stats);
+static void printheapstats(int n, stats_t *stats);
 static void printpassed(int n, stats_t *stats);
 static void printresultsgradescope(int n, stats_t *stats);
 
@@ -162,7 +208,7 @@ int main(int argc, char **argv) {
      * Read and interpret the command line arguments
      */
 
-    while ((c = getopt(argc, argv, "f:t:hvVgGalr")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:H:P:hvVgGalLr")) != EOF) {
         switch (c) {
             case 'r': /* start repl */
                 driver();
@@ -190,9 +236,29 @@ int main(int argc, char **argv) {
                 if (tracedir[strlen(tracedir) - 1] != '/')
                     strcat(tracedir, "/"); /* path always ends with "/" */
                 break;
+            case 'H': /* Heap ceiling in MB */
+                if (atol(optarg) <= 0) {
+                    usage();
+                    exit(1);
+                }
+                mem_set_max_heap((size_t)atol(optarg) << 20);
+                break;
+            case 'P': /* Back the heap with huge pages */
+                if (!strcmp(optarg, "thp")) {
+                    mem_set_huge_pages(MEM_PAGES_THP);
+                } else if (!strcmp(optarg, "hugetlb")) {
+                    mem_set_huge_pages(MEM_PAGES_HUGETLB);
+                } else {
+                    usage();
+                    exit(1);
+                }
+                break;
             case 'l': /* Run libc malloc */
                 run_libc = 1;
                 break;
+            case 'L': /* Measure per-op latency */
+                latency = 1;
+                break;
             case 'v': /* verbose mode -v */
                 verbose = 1;
                 break;
@@ -276,10 +342,13 @@ int main(int argc, char **argv) {
         if (mm_stats[i].valid) {
             if (verbose > 1) printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+            mm_get_stats(&mm_stats[i].heap);
             speed_params.trace = trace;
             speed_params.ranges = ranges;
             if (verbose > 1) printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+            if (latency) eval_mm_latency(trace, &mm_stats[i]);
+            if (verbose) eval_mm_dtlb(&speed_params, &mm_stats[i]);
         }
         free_trace(trace);
     }
@@ -289,6 +358,21 @@ int main(int argc, char **argv) {
         printf("\nResults for mm malloc:\n");
         printresults(num_tracefiles, mm_stats);
         printf("\n");
+        printf("Allocator counters for mm malloc:\n");
+        printheapstats(num_tracefiles, mm_stats);
+        printf("\n");
+        static const char *pages[] = {"small pages",
+                                      "transparent huge pages",
+                                      "hugetlb pages"};
+        printf("dTLB misses for mm malloc (heap on %s):\n",
+               pages[mem_huge_pages()]);
+        printdtlb(num_tracefiles, mm_stats);
+        printf("\n");
+    }
+    if (latency) {
+        printf("Per-op latency for mm malloc:\n");
+        printlatency(num_tracefiles, mm_stats);
+        printf("\n");
     }
 
     if (gradescope) {
@@ -340,30 +424,32 @@ int main(int argc, char **argv) {
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     size bytes at addr lo, aligned to alignment bytes. After checking
+ *     the block for correctness, we create a range struct for this block
+ *     and add it to the range list.
  */
-static int add_range(range_t **ranges, char *lo, int size, int tracenum,
-                     int opnum) {
+static int add_range(range_t **ranges, char *lo, size_t size,
+                     size_t alignment, int tracenum, int opnum) {
     if (!size) return 1;
 
     char *hi = lo + size - 1;
     range_t *p;
     char msg[MAXLINE];
 
-    assert(size > 0);
-
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
-        sprintf(msg, "Payload address (%p) not aligned to %d bytes", lo,
-                ALIGNMENT);
+    /* Payload addresses must be ALIGNMENT-byte aligned, or more if the
+     * request asked for it */
+    if (!IS_ALIGNED(lo, alignment)) {
+        sprintf(msg, "Payload address (%p) not aligned to %zu bytes", lo,
+                alignment);
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or else inside
+     * one of the mappings the allocator made with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, size)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)", lo, hi,
                 mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
@@ -442,7 +528,11 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index;
+    size_t size;
+    size_t alignment;
+    size_t count;
+    int arena = 0;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -480,25 +570,95 @@ static trace_t *read_trace(char *tracedir, char *filename) {
              (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
         unix_error("malloc 4 failed in read_trace");
 
+    /* a batch request takes at most every id there is */
+    if ((trace->batch = (void **)malloc(trace->num_ids * sizeof(void *))) ==
+        NULL)
+        unix_error("malloc 5 failed in read_trace");
+
     /* read every request line in the trace file */
+    trace->num_arenas = 0;
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
         switch (type[0]) {
-            case 'a':
-                _check(fscanf(tracefile, "%u %u", &index, &size));
-                trace->ops[op_index].type = ALLOC;
+            case 'm':
+                _check(fscanf(tracefile, "%u %zu %zu", &index, &alignment,
+                              &size));
+                trace->ops[op_index].type = MEMALIGN;
                 trace->ops[op_index].index = index;
                 trace->ops[op_index].size = size;
+                trace->ops[op_index].alignment = alignment;
+                max_index = (index > max_index) ? index : max_index;
+                break;
+            case 'a': /* a <id> <size>, aa <arena> <id> <size> or
+                         ar <arena> <id> <n> */
+                if (type[1] == '\0') {
+                    _check(fscanf(tracefile, "%u %zu", &index, &size));
+                    trace->ops[op_index].type = ALLOC;
+                    count = 1;
+                } else if (type[1] == 'a') {
+                    _check(fscanf(tracefile, "%d %u %zu", &arena, &index,
+                                  &size));
+                    trace->ops[op_index].type = ARENA_ALLOC;
+                    count = 1;
+                } else if (type[1] == 'r') {
+                    _check(fscanf(tracefile, "%d %u %zu", &arena, &index,
+                                  &count));
+                    trace->ops[op_index].type = ARENA_RESET;
+                    size = 0;
+                } else {
+                    printf("Bogus type (%s) in tracefile %s\n", type, path);
+                    exit(1);
+                }
+                if (type[1] != '\0') {
+                    trace->ops[op_index].arena = arena;
+                    if (arena >= trace->num_arenas)
+                        trace->num_arenas = arena + 1;
+                }
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                trace->ops[op_index].count = count;
+                trace->ops[op_index].alignment = ALIGNMENT;
+                max_index = (index + count - 1 > max_index)
+                                ? (unsigned)(index + count - 1)
+                                : max_index;
+                break;
+            case 'c':
+                _check(fscanf(tracefile, "%u %zu", &index, &size));
+                trace->ops[op_index].type = CALLOC;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                trace->ops[op_index].alignment = ALIGNMENT;
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'r':
-                _check(fscanf(tracefile, "%u %u", &index, &size));
+                _check(fscanf(tracefile, "%u %zu", &index, &size));
                 trace->ops[op_index].type = REALLOC;
                 trace->ops[op_index].index = index;
                 trace->ops[op_index].size = size;
+                trace->ops[op_index].alignment = ALIGNMENT;
                 max_index = (index > max_index) ? index : max_index;
                 break;
+            case 'b': /* ba <id> <n> <size> or bf <id> <n> */
+                if (type[1] == 'a') {
+                    _check(fscanf(tracefile, "%u %zu %zu", &index, &count,
+                                  &size));
+                    trace->ops[op_index].type = BATCH_ALLOC;
+                    trace->ops[op_index].size = size;
+                } else if (type[1] == 'f') {
+                    _check(fscanf(tracefile, "%u %zu", &index, &count));
+                    trace->ops[op_index].type = BATCH_FREE;
+                } else {
+                    printf("Bogus type (%s) in tracefile %s\n", type, path);
+                    exit(1);
+                }
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].count = count;
+                trace->ops[op_index].alignment = ALIGNMENT;
+                max_index = (index + count - 1 > max_index)
+                                ? (unsigned)(index + count - 1)
+                                : max_index;
+                break;
             case 'f':
                 _check(fscanf(tracefile, "%ud", &index));
                 trace->ops[op_index].type = FREE;
@@ -515,17 +675,25 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     assert((int)max_index == trace->num_ids - 1);
     assert((int)op_index == trace->num_ops);
 
+    /* the arenas themselves are created by each run, on its own heap */
+    if ((trace->arenas = (mm_arena_t **)calloc(trace->num_arenas,
+                                               sizeof(mm_arena_t *))) == NULL &&
+        trace->num_arenas > 0)
+        unix_error("malloc 6 failed in read_trace");
+
     return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
+ * free_trace - Free the trace record and the arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace) {
-    free(trace->ops); /* free the three arrays... */
+    free(trace->ops); /* free the arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
+    free(trace->batch);
+    free(trace->arenas);
     free(trace); /* and the trace record itself... */
 }
 
@@ -534,14 +702,71 @@ void free_trace(trace_t *trace) {
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * arenas_create - Creates the trace's arenas, on the heap mm_init just
+ *    set up
+ */
+static void arenas_create(trace_t *trace) {
+    int i;
+
+    for (i = 0; i < trace->num_arenas; i++)
+        if ((trace->arenas[i] = mm_arena_create()) == NULL)
+            app_error("mm_arena_create failed");
+}
+
+/*
+ * arenas_destroy - Destroys the trace's arenas, and everything still
+ *    allocated from them
+ */
+static void arenas_destroy(trace_t *trace) {
+    int i;
+
+    for (i = 0; i < trace->num_arenas; i++) mm_arena_destroy(trace->arenas[i]);
+}
+
+/*
+ * mm_alloc_op - Calls mm_malloc, mm_calloc, mm_memalign or mm_arena_alloc,
+ *    as the allocating request op asks
+ */
+static char *mm_alloc_op(trace_t *trace, traceop_t *op) {
+    switch (op->type) {
+        case CALLOC:
+            return mm_calloc(1, op->size);
+        case MEMALIGN:
+            return mm_memalign(op->alignment, op->size);
+        case ARENA_ALLOC:
+            return mm_arena_alloc(trace->arenas[op->arena], op->size);
+        default:
+            return mm_malloc(op->size);
+    }
+}
+
+/*
+ * libc_alloc_op - Calls malloc, calloc or posix_memalign, as the
+ *    allocating request op asks; an arena request is a plain malloc
+ */
+static char *libc_alloc_op(traceop_t *op) {
+    void *p;
+
+    switch (op->type) {
+        case CALLOC:
+            return calloc(1, op->size);
+        case MEMALIGN:
+            return posix_memalign(&p, op->alignment, op->size) ? NULL : p;
+        default:
+            return malloc(op->size);
+    }
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
-    int i, j;
+    int i;
+    size_t j, count;
     int index;
-    int size;
-    int oldsize;
+    size_t size;
+    size_t oldsize;
     char *newp;
     char *oldp;
     char *p;
@@ -555,6 +780,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
         malloc_error(tracenum, 0, "mm_init failed.");
         return 0;
     }
+    arenas_create(trace);
 
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++) {
@@ -562,10 +788,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
         size = trace->ops[i].size;
 
         switch (trace->ops[i].type) {
-            case ALLOC: /* mm_malloc */
+            case ALLOC:       /* mm_malloc */
+            case CALLOC:      /* mm_calloc */
+            case MEMALIGN:    /* mm_memalign */
+            case ARENA_ALLOC: /* mm_arena_alloc */
 
                 /* Call the student's malloc */
-                if ((p = mm_malloc(size)) == NULL && size) {
+                if ((p = mm_alloc_op(trace, &trace->ops[i])) == NULL && size) {
                     malloc_error(tracenum, i, "mm_malloc failed.");
                     return 0;
                 } else if (!size) {
@@ -578,7 +807,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                  * to the range list if OK. The block must be  be aligned
                  * properly, and must not overlap any currently allocated block.
                  */
-                if (add_range(ranges, p, size, tracenum, i) == 0) return 0;
+                if (add_range(ranges, p, size, trace->ops[i].alignment,
+                              tracenum, i) == 0)
+                    return 0;
+
+                /* a calloc'd block must read as zero throughout */
+                if (trace->ops[i].type == CALLOC) {
+                    for (j = 0; j < size; j++) {
+                        if (p[j] != 0) {
+                            malloc_error(tracenum, i,
+                                         "mm_calloc did not zero the block");
+                            return 0;
+                        }
+                    }
+                }
 
                 /* ADDED: cgw
                  * fill range with low byte of index.  This will be used later
@@ -609,7 +851,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 remove_range(ranges, oldp);
 
                 /* Check new block for correctness and add it to range list */
-                if (add_range(ranges, newp, size, tracenum, i) == 0) return 0;
+                if (add_range(ranges, newp, size, ALIGNMENT, tracenum, i) ==
+                    0)
+                    return 0;
 
                 /* ADDED: cgw
                  * Make sure that the new block contains the data from the old
@@ -619,7 +863,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 oldsize = trace->block_sizes[index];
                 if (size < oldsize) oldsize = size;
                 for (j = 0; j < oldsize; j++) {
-                    if (newp[j] != (index & 0xFF)) {
+                    if ((unsigned char)newp[j] != (index & 0xFF)) {
                         malloc_error(tracenum, i,
                                      "mm_realloc did not preserve the "
                                      "data from old block");
@@ -641,10 +885,45 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 mm_free(p);
                 break;
 
+            case BATCH_ALLOC: /* mm_malloc_batch */
+                count = trace->ops[i].count;
+                if (mm_malloc_batch(size, count, trace->batch) != count) {
+                    malloc_error(tracenum, i, "mm_malloc_batch failed.");
+                    return 0;
+                }
+                for (j = 0; j < count; j++) {
+                    p = trace->batch[j];
+                    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) ==
+                        0)
+                        return 0;
+                    memset(p, (index + j) & 0xFF, size);
+                    trace->blocks[index + j] = p;
+                    trace->block_sizes[index + j] = size;
+                }
+                break;
+
+            case BATCH_FREE: /* mm_free_batch */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++) {
+                    p = trace->blocks[index + j];
+                    remove_range(ranges, p);
+                    trace->batch[j] = p;
+                }
+                mm_free_batch(trace->batch, count);
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++)
+                    remove_range(ranges, trace->blocks[index + j]);
+                mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_valid");
         }
     }
+    arenas_destroy(trace);
 
     /* As far as we know, this is a valid malloc package */
     return 1;
@@ -654,11 +933,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/footprint, where footprint is the
+ *   most memory the student's malloc package held at any one time
+ *   while running the trace: the heap plus whatever it had mapped
+ *   with mem_map (see mem_peak_footprint). That high-water mark and
+ *   what the package still holds at the end of the trace, which is
+ *   less if it gave memory back, are recorded in mm_stats, along with
+ *   how much of the latter is still resident (see mem_resident).
  *
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
@@ -667,26 +948,34 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
 
     int i;
     int index;
-    int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t j, count;
+    size_t size, newsize, oldsize;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
     char *p;
     char *newp, *oldp;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
+    /* drop the pages earlier runs touched, so that the resident memory
+     * measured at the end is this run's alone */
+    mem_purge(mem_heap_lo(), mem_max_heapsize());
     clear_ranges(ranges);
     if (mm_init() < 0) app_error("mm_init failed in eval_mm_util");
+    arenas_create(trace);
     for (i = 0; i < trace->num_ops; i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
         switch (trace->ops[i].type) {
-            case ALLOC: /* mm_alloc */
+            case ALLOC:       /* mm_alloc */
+            case CALLOC:      /* mm_calloc */
+            case MEMALIGN:    /* mm_memalign */
+            case ARENA_ALLOC: /* mm_arena_alloc */
                 index = trace->ops[i].index;
                 size = trace->ops[i].size;
 
-                if ((p = mm_malloc(size)) == NULL && size) {
+                if ((p = mm_alloc_op(trace, &trace->ops[i])) == NULL && size) {
                     app_error("mm_malloc failed in eval_mm_util");
                 } else if (!size) {
                     // since we already checked that the return value should be
@@ -696,7 +985,9 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
 
                 /* Still need to memset, because otherwise there's no guarantee
                  * the space is usable */
-                if (add_range(ranges, p, size, tracenum, i) == 0) return 0;
+                if (add_range(ranges, p, size, trace->ops[i].alignment,
+                              tracenum, i) == 0)
+                    return 0;
                 memset(p, index & 0xFF, size);
 
                 /* Remember region and size */
@@ -728,7 +1019,9 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
                 /* Still need to memset and check region integrity */
                 remove_range(ranges, oldp);
 
-                if (add_range(ranges, newp, size, tracenum, i) == 0) return 0;
+                if (add_range(ranges, newp, size, ALIGNMENT, tracenum, i) ==
+                    0)
+                    return 0;
 
                 memset(newp, index & 0xFF, size);
 
@@ -739,7 +1032,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
 
                 /* Keep track of current total size
                  * of all allocated blocks */
-                total_size += (newsize - oldsize);
+                total_size = total_size - oldsize + newsize;
 
                 /* Update statistics */
                 max_total_size =
@@ -760,12 +1053,57 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
 
                 break;
 
+            case BATCH_ALLOC: /* mm_malloc_batch */
+                count = trace->ops[i].count;
+                if (mm_malloc_batch(size, count, trace->batch) != count)
+                    app_error("mm_malloc_batch failed in eval_mm_util");
+                for (j = 0; j < count; j++) {
+                    p = trace->batch[j];
+                    if (add_range(ranges, p, size, ALIGNMENT, tracenum, i) ==
+                        0)
+                        return 0;
+                    memset(p, (index + j) & 0xFF, size);
+                    trace->blocks[index + j] = p;
+                    trace->block_sizes[index + j] = size;
+                }
+                total_size += count * size;
+                max_total_size =
+                    (total_size > max_total_size) ? total_size : max_total_size;
+                break;
+
+            case BATCH_FREE: /* mm_free_batch */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++) {
+                    p = trace->blocks[index + j];
+                    remove_range(ranges, p);
+                    trace->batch[j] = p;
+                    total_size -= trace->block_sizes[index + j];
+                }
+                mm_free_batch(trace->batch, count);
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++) {
+                    remove_range(ranges, trace->blocks[index + j]);
+                    total_size -= trace->block_sizes[index + j];
+                }
+                mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_util");
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    mm_stats[tracenum].peak_footprint = mem_peak_footprint();
+    mm_stats[tracenum].final_footprint = mem_heapsize() + mem_mapped_bytes();
+    mm_stats[tracenum].final_resident = mem_resident();
+    arenas_destroy(trace);
+
+    /* the footprint is the most the heap and the mappings together ever
+     * took up */
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 /*
@@ -773,28 +1111,41 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges) {
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr) {
-    int i, index, size, newsize;
+    int i, index;
+    size_t j, count;
+    size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
     if (mm_init() < 0) app_error("mm_init failed in eval_mm_speed");
+    arenas_create(trace);
 
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
         switch (trace->ops[i].type) {
-            case ALLOC: /* mm_malloc */
+            case ALLOC:       /* mm_malloc */
+            case MEMALIGN:    /* mm_memalign */
+            case ARENA_ALLOC: /* mm_arena_alloc */
                 index = trace->ops[i].index;
                 size = trace->ops[i].size;
-                if ((p = mm_malloc(size)) == NULL)
+                if ((p = mm_alloc_op(trace, &trace->ops[i])) == NULL)
                     app_error("mm_malloc error in eval_mm_speed");
                 memset(p, index & 0xFF, size);
                 trace->blocks[index] = p;
                 break;
 
+            case CALLOC: /* mm_calloc */
+                /* the block comes back zeroed, which is what a caller
+                 * that wanted zeroed memory would otherwise memset */
+                if ((p = mm_calloc(1, size)) == NULL)
+                    app_error("mm_calloc error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
+
             case REALLOC: /* mm_realloc */
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
@@ -811,10 +1162,195 @@ static void eval_mm_speed(void *ptr) {
                 mm_free(block);
                 break;
 
+            case BATCH_ALLOC: /* mm_malloc_batch */
+                count = trace->ops[i].count;
+                if (mm_malloc_batch(size, count, trace->batch) != count)
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                for (j = 0; j < count; j++) {
+                    p = trace->batch[j];
+                    memset(p, (index + j) & 0xFF, size);
+                    trace->blocks[index + j] = p;
+                }
+                break;
+
+            case BATCH_FREE: /* mm_free_batch */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++)
+                    trace->batch[j] = trace->blocks[index + j];
+                mm_free_batch(trace->batch, count);
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+                break;
+
             default:
                 app_error("Nonexistent request type in eval_mm_valid");
         }
     }
+    arenas_destroy(trace);
+}
+
+/* compares two latency samples for qsort */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* returns the current monotonic time in ns */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * eval_mm_latency - Replays the trace once, timing every mm call on its
+ *    own, and records the 99th percentile and maximum call latency.
+ *    Unlike eval_mm_speed this shows the tail that a throughput number
+ *    averages away.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats) {
+    int i, index;
+    size_t j, count;
+    size_t size;
+    char *p;
+    double start, *samples;
+
+    if ((samples = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+        unix_error("malloc failed in eval_mm_latency");
+
+    mem_reset_brk();
+    if (mm_init() < 0) app_error("mm_init failed in eval_mm_latency");
+    arenas_create(trace);
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+            case ALLOC:       /* mm_malloc */
+            case MEMALIGN:    /* mm_memalign */
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                start = now_ns();
+                p = mm_alloc_op(trace, &trace->ops[i]);
+                samples[i] = now_ns() - start;
+                if (p == NULL) app_error("mm_malloc error in eval_mm_latency");
+                memset(p, index & 0xFF, size);
+                trace->blocks[index] = p;
+                break;
+
+            case CALLOC: /* mm_calloc */
+                start = now_ns();
+                p = mm_calloc(1, size);
+                samples[i] = now_ns() - start;
+                if (p == NULL) app_error("mm_calloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                start = now_ns();
+                p = mm_realloc(trace->blocks[index], size);
+                samples[i] = now_ns() - start;
+                if (p == NULL) app_error("mm_realloc error in eval_mm_latency");
+                memset(p, index & 0xFF, size);
+                trace->blocks[index] = p;
+                break;
+
+            case FREE: /* mm_free */
+                start = now_ns();
+                mm_free(trace->blocks[index]);
+                samples[i] = now_ns() - start;
+                break;
+
+            case BATCH_ALLOC: /* mm_malloc_batch */
+                count = trace->ops[i].count;
+                start = now_ns();
+                j = mm_malloc_batch(size, count, trace->batch);
+                samples[i] = now_ns() - start;
+                if (j != count)
+                    app_error("mm_malloc_batch error in eval_mm_latency");
+                for (j = 0; j < count; j++) {
+                    p = trace->batch[j];
+                    memset(p, (index + j) & 0xFF, size);
+                    trace->blocks[index + j] = p;
+                }
+                break;
+
+            case BATCH_FREE: /* mm_free_batch */
+                count = trace->ops[i].count;
+                for (j = 0; j < count; j++)
+                    trace->batch[j] = trace->blocks[index + j];
+                start = now_ns();
+                mm_free_batch(trace->batch, count);
+                samples[i] = now_ns() - start;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                start = now_ns();
+                mm_arena_reset(trace->arenas[trace->ops[i].arena]);
+                samples[i] = now_ns() - start;
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_latency");
+        }
+    }
+    arenas_destroy(trace);
+
+    qsort(samples, trace->num_ops, sizeof(double), cmp_double);
+    stats->lat_p99 = samples[(int)(0.99 * (trace->num_ops - 1))];
+    stats->lat_max = samples[trace->num_ops - 1];
+    free(samples);
+}
+
+/*
+ * eval_mm_dtlb - Replays the trace once with the dTLB miss counters on, and
+ *    records how many load and store misses it caused, or -1 if the
+ *    counters cannot be opened (no PMU in a VM, perf_event_paranoid, ...).
+ */
+static void eval_mm_dtlb(speed_t *params, stats_t *stats) {
+    stats->dtlb_misses = -1;
+#ifdef __linux__
+    static const unsigned long long ops[] = {PERF_COUNT_HW_CACHE_OP_READ,
+                                             PERF_COUNT_HW_CACHE_OP_WRITE};
+    int fds[2];
+    int n = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (ops[i] << 8) |
+                      ((unsigned long long)PERF_COUNT_HW_CACHE_RESULT_MISS
+                       << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* some CPUs count only load misses */
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0) fds[n++] = fd;
+    }
+    if (n == 0) return;
+
+    for (i = 0; i < n; i++) {
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    eval_mm_speed(params);
+    stats->dtlb_misses = 0;
+    for (i = 0; i < n; i++) {
+        long long count = 0;
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+            stats->dtlb_misses += count;
+        close(fds[i]);
+    }
+#else
+    (void)params;
+#endif
 }
 
 /*
@@ -824,13 +1360,18 @@ static void eval_mm_speed(void *ptr) {
  *
  */
 static int eval_libc_valid(trace_t *trace, int tracenum) {
-    int i, newsize;
+    int i;
+    size_t j;
+    size_t newsize;
     char *p, *newp, *oldp;
 
     for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
-            case ALLOC: /* malloc */
-                if ((p = malloc(trace->ops[i].size)) == NULL) {
+            case ALLOC:       /* malloc */
+            case CALLOC:      /* calloc */
+            case MEMALIGN:    /* posix_memalign */
+            case ARENA_ALLOC: /* malloc */
+                if ((p = libc_alloc_op(&trace->ops[i])) == NULL) {
                     malloc_error(tracenum, i, "libc malloc failed");
                     unix_error("System message");
                 }
@@ -851,6 +1392,22 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
                 free(trace->blocks[trace->ops[i].index]);
                 break;
 
+            case BATCH_ALLOC: /* one malloc per block */
+                for (j = 0; j < trace->ops[i].count; j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL) {
+                        malloc_error(tracenum, i, "libc malloc failed");
+                        unix_error("System message");
+                    }
+                    trace->blocks[trace->ops[i].index + j] = p;
+                }
+                break;
+
+            case BATCH_FREE:  /* one free per block */
+            case ARENA_RESET: /* one free per block */
+                for (j = 0; j < trace->ops[i].count; j++)
+                    free(trace->blocks[trace->ops[i].index + j]);
+                break;
+
             default:
                 app_error("invalid operation type  in eval_libc_valid");
         }
@@ -866,16 +1423,20 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
  */
 static void eval_libc_speed(void *ptr) {
     int i;
-    int index, size, newsize;
+    int index;
+    size_t j;
+    size_t newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
-            case ALLOC: /* malloc */
+            case ALLOC:       /* malloc */
+            case CALLOC:      /* calloc */
+            case MEMALIGN:    /* posix_memalign */
+            case ARENA_ALLOC: /* malloc */
                 index = trace->ops[i].index;
-                size = trace->ops[i].size;
-                if ((p = malloc(size)) == NULL)
+                if ((p = libc_alloc_op(&trace->ops[i])) == NULL)
                     unix_error("malloc failed in eval_libc_speed");
                 trace->blocks[index] = p;
                 break;
@@ -895,6 +1456,22 @@ static void eval_libc_speed(void *ptr) {
                 block = trace->blocks[index];
                 free(block);
                 break;
+
+            case BATCH_ALLOC: /* one malloc per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < trace->ops[i].count; j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL)
+                        unix_error("malloc failed in eval_libc_speed");
+                    trace->blocks[index + j] = p;
+                }
+                break;
+
+            case BATCH_FREE:  /* one free per block */
+            case ARENA_RESET: /* one free per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < trace->ops[i].count; j++)
+                    free(trace->blocks[index + j]);
+                break;
         }
     }
 }
@@ -971,6 +1548,93 @@ static void printresults(int n, stats_t *stats) {
     }
 }
 
+/*
+ * printheapstats - prints the counters mm_get_stats reported for each trace
+ */
+static void printheapstats(int n, stats_t *stats) {
+    int i;
+
+    printf("%6s %4s                %9s %9s %9s %9s %6s %6s %6s %9s %9s %9s "
+           "%9s %9s\n",
+           "trace#", " name", "splits", "merges", "fast hits", "consol",
+           "sbrks", "trims", "purges", "peak KB", "final KB", "rss KB",
+           "copied KB", "zero KB");
+    printf(
+        "----------------------------------------------------------------------"
+        "---------------------------------------------------------------------"
+        "\n");
+    for (i = 0; i < n; i++) {
+        if (stats[i].valid) {
+            printf(" %-2d     %-19s   %9lu %9lu %9lu %9lu %6lu %6lu %6lu %9zu "
+                   "%9zu %9zu %9lu %9lu\n",
+                   i, stats[i].trace_name, stats[i].heap.splits,
+                   stats[i].heap.coalesces, stats[i].heap.fastbin_hits,
+                   stats[i].heap.consolidations, stats[i].heap.sbrks,
+                   stats[i].heap.trims,
+                   stats[i].heap.purges, stats[i].peak_footprint / 1024,
+                   stats[i].final_footprint / 1024,
+                   stats[i].final_resident / 1024,
+                   stats[i].heap.realloc_copied / 1024,
+                   stats[i].heap.calloc_skipped / 1024);
+        } else {
+            printf(" %-2d     %-19s   %9s %9s %9s %9s %6s %6s %6s %9s %9s %9s "
+                   "%9s %9s\n",
+                   i, stats[i].trace_name, "-", "-", "-", "-", "-", "-", "-",
+                   "-", "-", "-", "-", "-");
+        }
+    }
+}
+
+/*
+ * printlatency - prints the per-op latency measured by eval_mm_latency
+ */
+static void printlatency(int n, stats_t *stats) {
+    int i;
+    double worst = 0;
+
+    printf("%6s %4s                %12s %12s\n", "trace#", " name",
+           "p99 (ns)", "max (ns)");
+    printf(
+        "----------------------------------------------------------------------"
+        "-"
+        "\n");
+    for (i = 0; i < n; i++) {
+        if (stats[i].valid) {
+            printf(" %-2d     %-19s   %12.0f %12.0f\n", i, stats[i].trace_name,
+                   stats[i].lat_p99, stats[i].lat_max);
+            worst = (stats[i].lat_max > worst) ? stats[i].lat_max : worst;
+        } else {
+            printf(" %-2d     %-19s   %12s %12s\n", i, stats[i].trace_name, "-",
+                   "-");
+        }
+    }
+    printf("%-32s%25.0f\n", "Worst", worst);
+}
+
+/*
+ * printdtlb - prints the dTLB misses one run of each trace caused
+ */
+static void printdtlb(int n, stats_t *stats) {
+    int i;
+
+    printf("%6s %4s                %12s %12s\n", "trace#", " name", "misses",
+           "per op");
+    printf(
+        "----------------------------------------------------------------------"
+        "-"
+        "\n");
+    for (i = 0; i < n; i++) {
+        if (stats[i].valid && stats[i].dtlb_misses >= 0) {
+            printf(" %-2d     %-19s   %12lld %12.3f\n", i, stats[i].trace_name,
+                   stats[i].dtlb_misses,
+                   (double)stats[i].dtlb_misses / stats[i].ops);
+        } else {
+            printf(" %-2d     %-19s   %12s %12s\n", i, stats[i].trace_name,
+                   stats[i].valid ? "n/a" : "-", stats[i].valid ? "n/a" : "-");
+        }
+    }
+}
+
 static void printresultsgradescope(int n, stats_t *stats) {
     int i;
     double util = 0;
@@ -1082,13 +1746,22 @@ void malloc_error(int tracenum, int opnum, char *msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-    fprintf(stderr, "Usage: mdriver [-hvValr] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr,
+            "Usage: mdriver [-hvValLr] [-f <file>] [-t <dir>] [-H <MB>] "
+            "[-P thp|hugetlb]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-r         Open the malloc REPL.\n");
     fprintf(stderr, "\t-G         Generates a ./gradescope-report.txt file.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr,
+            "\t-H <MB>    Let the heap grow to <MB> megabytes (default: "
+            "$MEM_MAX_HEAP, or 20 MB).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report p99 and max per-op latency.\n");
+    fprintf(stderr,
+            "\t-P <kind>  Back the heap with huge pages: 'thp' (madvise) "
+            "or 'hugetlb'.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -1163,10 +1836,10 @@ repl_block_t *find_repl_block_from_block(char *block_ptr, repl_block_t blocks[],
 void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
     // prints heap data & prologue
     block_t *heap_start = (block_t *)mem_heap_lo();
-    printf("heap size: %d\n", (int)mem_heapsize());
+    printf("heap size: %zu\n", mem_heapsize());
     block_t *b = (block_t *)heap_start;
-    printf("prologue \t\tblock at %p \tsize %d\n", (void *)heap_start,
-           (int)block_size(heap_start));
+    printf("prologue \t\tblock at %p \tsize %zu\n", (void *)heap_start,
+           block_size(heap_start));
     b = block_next(b);
 
     block_t *epilogue = (block_t *)((char *)mem_heap_hi() - TAGS_SIZE + 1);
@@ -1187,31 +1860,32 @@ void mm_print_heap_repl(repl_block_t blocks[], int repl_size) {
         if (index != -1) sprintf(indexstr, "[%d]", index);
 
         if (block_allocated(b)) {
-            printf("block%s allocated \tblock at %p \tsize %d\n", indexstr,
-                   (void *)(b), (int)block_size(b));
+            printf("block%s allocated \tblock at %p \tsize %zu\n", indexstr,
+                   (void *)(b), block_size(b));
         } else {
             printf(
-                "free block \t\tblock at %p \tsize %d \tNext: %p\tPrev: %p\n",
-                (void *)(b), (int)block_size(b), (void *)(block_flink(b)),
+                "free block \t\tblock at %p \tsize %zu \tNext: %p\tPrev: %p\n",
+                (void *)(b), block_size(b), (void *)(block_flink(b)),
                 (void *)block_blink(b));
         }
         size_t s1 = block_size(b);
-        size_t s2 = block_end_size(b);
+        // only free blocks carry an end tag
+        size_t s2 = block_allocated(b) ? s1 : block_end_size(b);
         if (s1 != s2) {
-            printf("block%s at %p had differing size tags: %d and %d\n\n",
-                   indexstr, (void *)b, (int)s1, (int)s2);
+            printf("block%s at %p had differing size tags: %zu and %zu\n\n",
+                   indexstr, (void *)b, s1, s2);
         }
         if (s1 < MINBLOCKSIZE) {
-            printf("block%s at %p had too small a size: %d\n\n", indexstr,
-                   (void *)b, (int)s1);
+            printf("block%s at %p had too small a size: %zu\n\n", indexstr,
+                   (void *)b, s1);
         }
         if (block_next(b) > epilogue + MINBLOCKSIZE) {
             printf("next block wasn't in the heap. \n\n");
         }
         b = block_next(b);
     }
-    printf("epilogue \t\tblock at %p \tsize %d\n\n\n", (void *)(epilogue),
-           (int)block_size(epilogue));
+    printf("epilogue \t\tblock at %p \tsize %zu\n\n\n", (void *)(epilogue),
+           block_size(epilogue));
     // return 0;
 }
 
@@ -1257,8 +1931,8 @@ void print_cmd(const char *msg) {
 
         block_t *b = (block_t *)(repl_state->blocks[index].ptr - 8);
         if (block_allocated(b)) {
-            printf("block[%d] allocated \tblock at %p \tsize %d\n", index,
-                   (void *)(b), (int)block_size(b));
+            printf("block[%d] allocated \tblock at %p \tsize %zu\n", index,
+                   (void *)(b), block_size(b));
         }
         return;
     }
@@ -1302,10 +1976,11 @@ void quit_cmd(const char *msg) {
 }
 
 void malloc_cmd(const char *msg) {
-    int index, size;
+    int index;
+    size_t size;
     char *p;
-    if ((sscanf(msg, "m %d %d", &index, &size) != 2) &&
-        (sscanf(msg, "malloc %d %d", &index, &size) != 2)) {
+    if ((sscanf(msg, "m %d %zu", &index, &size) != 2) &&
+        (sscanf(msg, "malloc %d %zu", &index, &size) != 2)) {
         printf("%s\n", "usage: malloc <index> <amount>");
         return;
     }
@@ -1334,7 +2009,8 @@ void malloc_cmd(const char *msg) {
      * to the range list if OK. The block must be  be aligned properly,
      * and must not overlap any currently allocated block.
      */
-    if (add_range(&(repl_state->ranges), p, size, repl_state->tracenum,
+    if (add_range(&(repl_state->ranges), p, size, ALIGNMENT,
+                  repl_state->tracenum,
                   repl_state->num_ops) == 0)
         return;
 
@@ -1379,11 +2055,12 @@ void free_cmd(const char *msg) {
 }
 
 void remalloc_cmd(const char *msg) {
-    int index, size, j;
+    int index;
+    size_t size, j;
     char *newp;
     char *oldp;
-    if ((sscanf(msg, "r %d %d", &index, &size) != 2) &&
-        (sscanf(msg, "realloc %d %d", &index, &size) != 2)) {
+    if ((sscanf(msg, "r %d %zu", &index, &size) != 2) &&
+        (sscanf(msg, "realloc %d %zu", &index, &size) != 2)) {
         printf("%s\n", "usage: r <index> <size>");
         return;
     }
@@ -1411,7 +2088,8 @@ void remalloc_cmd(const char *msg) {
     remove_range(&(repl_state->ranges), oldp);
 
     /* Check new block for correctness and add it to range list */
-    if (add_range(&(repl_state->ranges), newp, size, repl_state->tracenum,
+    if (add_range(&(repl_state->ranges), newp, size, ALIGNMENT,
+                  repl_state->tracenum,
                   repl_state->num_ops) == 0)
         return;
 
@@ -1420,10 +2098,10 @@ void remalloc_cmd(const char *msg) {
      * block and then fill in the new block with the low order byte
      * of the new index
      */
-    int oldsize = repl_state->blocks[index].size;
+    size_t oldsize = repl_state->blocks[index].size;
     if (size < oldsize) oldsize = size;
     for (j = 0; j < oldsize; j++) {
-        if (newp[j] != (index & 0xFF)) {
+        if ((unsigned char)newp[j] != (index & 0xFF)) {
             malloc_error(repl_state->tracenum, repl_state->num_ops,
                          "mm_realloc did not preserve the "
                          "data from old block");
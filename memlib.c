@@ -3,8 +3,10 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,51 +17,405 @@
 #include "memlib.h"
 
 /* private variables */
-static char *mem_start_brk; /* points to first byte of heap */
-static char *mem_brk;       /* points to last byte of heap */
-static char *mem_max_addr;  /* largest legal heap address */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */
+static char *mem_commit_brk; /* end of the pages made accessible so far */
+static char *mem_fresh;      /* heap pages from here up read as zero */
+static size_t mem_max_heap;  /* ceiling set with mem_set_max_heap, or 0 */
+static int mem_pages_wanted = -1; /* set with mem_set_huge_pages, or -1 */
+static int mem_pages;        /* MEM_PAGES_* backing the heap now */
+static size_t mem_commit_chunk; /* pages are committed this many bytes at a time */
+
+/* the commit step with ordinary pages */
+#define MEM_COMMIT_CHUNK (64 * 1024)
+/* the size of a huge page, and the heap's alignment and commit step when
+ * it asks for them */
+#define MEM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* mappings handed out by mem_map that have not been unmapped yet */
+typedef struct mem_mapping {
+    char *addr;
+    size_t size;
+    struct mem_mapping *next;
+} mem_mapping_t;
+
+static mem_mapping_t *mem_mappings;
+static size_t mem_mapped;        /* bytes currently mapped by mem_map */
+static size_t mem_peak;          /* largest heap size + mem_mapped so far */
+
+/* records a new high-water mark of heap plus mapped bytes */
+static void mem_update_peak(void) {
+    size_t footprint = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+    if (footprint > mem_peak) mem_peak = footprint;
+}
+
+/* unmaps every mapping still registered */
+static void mem_unmap_all(void) {
+    while (mem_mappings != NULL) {
+        mem_mapping_t *m = mem_mappings;
+        mem_mappings = m->next;
+        munmap(m->addr, m->size);
+        free(m);
+    }
+    mem_mapped = 0;
+}
 
 /*
- * mem_init - initialize the memory system model
+ * mem_set_max_heap - sets the most bytes the heap may grow to, taking
+ *    effect at the next mem_init. Without it, the ceiling is the value of
+ *    the MEM_MAX_HEAP environment variable (a number of bytes, optionally
+ *    followed by K, M or G), or MAX_HEAP if that is not set.
+ */
+void mem_set_max_heap(size_t size) { mem_max_heap = size; }
+
+/* works out the heap ceiling for mem_init */
+static size_t mem_heap_ceiling(void) {
+    const char *env = getenv("MEM_MAX_HEAP");
+    char *end;
+    unsigned long long size;
+
+    if (mem_max_heap != 0) return mem_max_heap;
+    if (env == NULL) return MAX_HEAP;
+    size = strtoull(env, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': size <<= 10; /* fall through */
+        case 'm': case 'M': size <<= 10; /* fall through */
+        case 'k': case 'K': size <<= 10; break;
+        case '\0': break;
+        default: size = 0;
+    }
+    if (size == 0) {
+        fprintf(stderr, "mem_init_vm: bad MEM_MAX_HEAP \"%s\"\n", env);
+        exit(1);
+    }
+    return (size_t)size;
+}
+
+/*
+ * mem_set_huge_pages - chooses what backs the heap from the next mem_init
+ *    on: MEM_PAGES_SMALL, MEM_PAGES_THP or MEM_PAGES_HUGETLB. Without it,
+ *    the MEM_HUGE_PAGES environment variable ("thp" or "hugetlb") decides,
+ *    and ordinary pages are used if that is not set either.
+ */
+void mem_set_huge_pages(int mode) { mem_pages_wanted = mode; }
+
+/*
+ * mem_huge_pages - returns the MEM_PAGES_* mode actually backing the heap,
+ *    which is MEM_PAGES_THP if MEM_PAGES_HUGETLB was asked for but the
+ *    hugetlb pool could not supply the heap
+ */
+int mem_huge_pages(void) { return mem_pages; }
+
+/* works out the page mode asked for */
+static int mem_page_mode(void) {
+    const char *env = getenv("MEM_HUGE_PAGES");
+
+    if (mem_pages_wanted >= 0) return mem_pages_wanted;
+    if (env == NULL) return MEM_PAGES_SMALL;
+    if (!strcmp(env, "thp")) return MEM_PAGES_THP;
+    if (!strcmp(env, "hugetlb")) return MEM_PAGES_HUGETLB;
+    fprintf(stderr, "mem_init_vm: bad MEM_HUGE_PAGES \"%s\"\n", env);
+    exit(1);
+}
+
+/*
+ * mem_init - initialize the memory system model. The whole heap is
+ *    reserved as address space up front, but its pages are only made
+ *    accessible (committed) as mem_sbrk reaches them, so a high ceiling
+ *    costs nothing until it is used. With huge pages, the heap starts on
+ *    a huge page boundary and is committed a huge page at a time; with
+ *    MEM_PAGES_HUGETLB, it is mapped from the hugetlb pool in one go.
  */
 void mem_init(void) {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-        fprintf(stderr, "mem_init_vm: malloc error\n");
+    size_t size = mem_heap_ceiling();
+    int mode = mem_page_mode();
+    size_t align = mode == MEM_PAGES_SMALL ? mem_pagesize() : MEM_HUGE_PAGE_SIZE;
+    char *base;
+
+    size = (size + align - 1) & ~(align - 1);
+    mem_pages = MEM_PAGES_SMALL;
+    mem_commit_chunk = MEM_COMMIT_CHUNK;
+    if (mode == MEM_PAGES_HUGETLB) {
+        /* without MAP_NORESERVE the pool's pages are set aside now, so
+         * this fails here rather than with a SIGBUS on first touch */
+        mem_start_brk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem_start_brk != MAP_FAILED) {
+            mem_pages = MEM_PAGES_HUGETLB;
+            mem_max_addr = mem_start_brk + size;
+            mem_brk = mem_start_brk;
+            mem_commit_brk = mem_max_addr; /* all of it is usable already */
+            mem_fresh = mem_start_brk;
+            return;
+        }
+        fprintf(stderr, "mem_init_vm: hugetlb pool too small, using "
+                        "transparent huge pages\n");
+        mode = MEM_PAGES_THP;
+    }
+
+    /* reserve the range we will use to model the available VM, with room
+     * to spare for moving its start to a huge page boundary */
+    base = mmap(NULL, size + align - mem_pagesize(), PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "mem_init_vm: mmap error\n");
         exit(1);
     }
+    mem_start_brk = (char *)(((uintptr_t)base + align - 1) & ~(align - 1));
+    if (mem_start_brk > base) munmap(base, (size_t)(mem_start_brk - base));
+    if (base + size + align - mem_pagesize() > mem_start_brk + size)
+        munmap(mem_start_brk + size,
+               (size_t)(base + size + align - mem_pagesize() -
+                        (mem_start_brk + size)));
+    if (mode == MEM_PAGES_THP) {
+        /* the advice sticks to the range as mprotect commits it */
+        madvise(mem_start_brk, size, MADV_HUGEPAGE);
+        mem_pages = MEM_PAGES_THP;
+        mem_commit_chunk = MEM_HUGE_PAGE_SIZE;
+    }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
-    mem_brk = mem_start_brk;                 /* heap is empty initially */
+    mem_max_addr = mem_start_brk + size; /* max legal heap address */
+    mem_brk = mem_start_brk;             /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;      /* and nothing is committed */
+    mem_fresh = mem_start_brk;           /* nor written */
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
-void mem_deinit(void) { free(mem_start_brk); }
+void mem_deinit(void) {
+    mem_unmap_all();
+    munmap(mem_start_brk, (size_t)(mem_max_addr - mem_start_brk));
+}
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and drop any mappings left over from the last run. Committed pages
+ *    stay committed, so the next run does not pay to commit them again.
  */
-void mem_reset_brk() { mem_brk = mem_start_brk; }
+void mem_reset_brk() {
+    mem_brk = mem_start_brk;
+    mem_unmap_all();
+    mem_peak = 0;
+}
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area, or
+ *    shrinks it by -incr bytes when incr is negative and returns the
+ *    old break. Pages are committed as the break moves past them and
+ *    given back when the heap shrinks below them.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
     char *old_brk = mem_brk;
 
-    if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((incr < 0 && -incr > mem_brk - mem_start_brk) ||
+        (incr > 0 && (uintptr_t)incr > (uintptr_t)(mem_max_addr - mem_brk))) {
         errno = ENOMEM;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_commit_brk) {
+        /* commit a chunk at a time to keep mprotect calls rare */
+        size_t grow = (size_t)(mem_brk - mem_commit_brk);
+        grow = (grow + mem_commit_chunk - 1) & ~(mem_commit_chunk - 1);
+        if (grow > (size_t)(mem_max_addr - mem_commit_brk))
+            grow = (size_t)(mem_max_addr - mem_commit_brk);
+        if (mprotect(mem_commit_brk, grow, PROT_READ | PROT_WRITE) < 0) {
+            mem_brk = old_brk;
+            errno = ENOMEM;
+            fprintf(stderr, "ERROR: mem_sbrk failed. Cannot commit memory\n");
+            return (void *)-1;
+        }
+        mem_commit_brk += grow;
+    } else if (incr < 0 && mem_pages != MEM_PAGES_HUGETLB &&
+               (size_t)(mem_commit_brk - mem_brk) >= 2 * mem_commit_chunk) {
+        /* decommit what the heap gave back, keeping a chunk for regrowth */
+        size_t kept = ((size_t)(mem_brk - mem_start_brk) +
+                       2 * mem_commit_chunk - 1) &
+                      ~(mem_commit_chunk - 1);
+        char *keep = mem_start_brk + kept;
+        size_t drop = (size_t)(mem_commit_brk - keep);
+        madvise(keep, drop, MADV_DONTNEED);
+        mprotect(keep, drop, PROT_NONE);
+        mem_commit_brk = keep;
+        if (mem_fresh > keep) mem_fresh = keep;
+    }
+    /* what lies below the break may be written from now on */
+    if (mem_brk > mem_fresh) mem_fresh = mem_brk;
+    mem_update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - maps size bytes (a multiple of the page size) of fresh,
+ *    zeroed memory outside the heap, for blocks too big to keep in it.
+ *    Returns the start of the mapping, or (void *)-1 on failure.
+ */
+void *mem_map(size_t size) {
+    mem_mapping_t *m;
+    char *addr;
+
+    assert(size % mem_pagesize() == 0);
+    if ((m = (mem_mapping_t *)malloc(sizeof(mem_mapping_t))) == NULL)
+        return (void *)-1;
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        free(m);
+        fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    m->addr = addr;
+    m->size = size;
+    m->next = mem_mappings;
+    mem_mappings = m;
+    mem_mapped += size;
+    mem_update_peak();
+    return addr;
+}
+
+/*
+ * mem_unmap - gives back a whole mapping made by mem_map. Returns 0, or
+ *    -1 if addr and size do not name one.
+ */
+int mem_unmap(void *addr, size_t size) {
+    mem_mapping_t **link;
+
+    for (link = &mem_mappings; *link != NULL; link = &(*link)->next) {
+        mem_mapping_t *m = *link;
+        if (m->addr == addr && m->size == size) {
+            *link = m->next;
+            munmap(m->addr, m->size);
+            mem_mapped -= m->size;
+            free(m);
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * mem_remap - resizes a mapping made by mem_map to newsize bytes (a
+ *    multiple of the page size) with mremap, which moves the pages, not
+ *    their contents, if the mapping cannot grow where it is. Returns the
+ *    mapping's (possibly new) address, or (void *)-1 on failure, in which
+ *    case the old mapping is left as it was.
+ */
+void *mem_remap(void *addr, size_t oldsize, size_t newsize) {
+    mem_mapping_t *m;
+    char *newaddr;
+
+    assert(newsize % mem_pagesize() == 0);
+    for (m = mem_mappings; m != NULL; m = m->next) {
+        if (m->addr == addr && m->size == oldsize) break;
+    }
+    if (m == NULL) {
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    newaddr = mremap(addr, oldsize, newsize, MREMAP_MAYMOVE);
+    if (newaddr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    m->addr = newaddr;
+    m->size = newsize;
+    mem_mapped = mem_mapped - oldsize + newsize;
+    mem_update_peak();
+    return newaddr;
+}
+
+/*
+ * mem_fresh_lo - returns the lowest heap address from which no page has
+ *    been below the break since it was last zeroed (by the OS on first
+ *    commit, or by mem_sbrk or mem_purge giving it back). Memory mem_sbrk
+ *    hands out from there up reads as zero.
+ */
+void *mem_fresh_lo(void) { return (void *)mem_fresh; }
+
+/*
+ * mem_is_mapped - returns 1 if [lo, lo + size) lies inside a single
+ *    mapping made by mem_map, 0 otherwise
+ */
+int mem_is_mapped(void *lo, size_t size) {
+    mem_mapping_t *m;
+
+    for (m = mem_mappings; m != NULL; m = m->next) {
+        if ((char *)lo >= m->addr && (char *)lo + size <= m->addr + m->size)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * mem_mapped_bytes - returns the number of bytes currently mapped by
+ *    mem_map
+ */
+size_t mem_mapped_bytes(void) { return mem_mapped; }
+
+/*
+ * mem_peak_footprint - returns the most memory (heap plus mappings) in use
+ *    at any one time since the last mem_reset_brk
+ */
+size_t mem_peak_footprint(void) { return mem_peak; }
+
+/*
+ * mem_purge - gives the physical pages lying wholly inside [lo, lo + size)
+ *    back to the OS with madvise(MADV_DONTNEED). They stay mapped and read
+ *    as zero when next touched. Returns the number of bytes given back.
+ */
+size_t mem_purge(void *lo, size_t size) {
+    uintptr_t pagesize = (uintptr_t)mem_pagesize();
+    uintptr_t start = ((uintptr_t)lo + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t end = ((uintptr_t)lo + size) & ~(pagesize - 1);
+
+    /* hugetlb pages can only be given back whole, which these rarely are */
+    if (mem_pages == MEM_PAGES_HUGETLB && (char *)lo >= mem_start_brk &&
+        (char *)lo < mem_max_addr)
+        return 0;
+    if (end <= start || madvise((void *)start, end - start, MADV_DONTNEED) < 0)
+        return 0;
+    /* a purge reaching up to the fresh pages makes them start lower */
+    if (start >= (uintptr_t)mem_start_brk && start < (uintptr_t)mem_fresh &&
+        end >= (uintptr_t)mem_fresh)
+        mem_fresh = (char *)start;
+    return (size_t)(end - start);
+}
+
+/* counts the resident bytes of the pages overlapping [lo, hi) */
+static size_t mem_resident_range(char *lo, char *hi) {
+    uintptr_t pagesize = (uintptr_t)mem_pagesize();
+    uintptr_t start = (uintptr_t)lo & ~(pagesize - 1);
+    size_t pages = ((uintptr_t)hi - start + pagesize - 1) / pagesize;
+    unsigned char *vec;
+    size_t i, resident = 0;
+
+    if (hi <= lo || (vec = (unsigned char *)malloc(pages)) == NULL) return 0;
+    if (mincore((void *)start, pages * pagesize, vec) == 0) {
+        for (i = 0; i < pages; i++)
+            if (vec[i] & 1) resident += pagesize;
+    }
+    free(vec);
+    return resident;
+}
+
+/*
+ * mem_resident - returns how much of the heap and of the mappings made by
+ *    mem_map is backed by physical memory right now, according to mincore
+ */
+size_t mem_resident(void) {
+    mem_mapping_t *m;
+    size_t resident = mem_resident_range(mem_start_brk, mem_brk);
+
+    for (m = mem_mappings; m != NULL; m = m->next)
+        resident += mem_resident_range(m->addr, m->addr + m->size);
+    return resident;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -70,6 +426,11 @@ void *mem_heap_lo() { return (void *)mem_start_brk; }
  */
 void *mem_heap_hi() { return (void *)(mem_brk - 1); }
 
+/*
+ * mem_max_heapsize() - returns the most bytes the heap may grow to
+ */
+size_t mem_max_heapsize() { return (size_t)(mem_max_addr - mem_start_brk); }
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -1,15 +1,36 @@
 #ifndef MEMLIB_H
 #define MEMLIB_H
 
+#include <stdint.h>
 #include <unistd.h>
 
+/* what backs the heap (see mem_set_huge_pages) */
+#define MEM_PAGES_SMALL 0   /* ordinary pages */
+#define MEM_PAGES_THP 1     /* transparent huge pages, asked for with madvise */
+#define MEM_PAGES_HUGETLB 2 /* huge pages from the hugetlb pool */
+
+void mem_set_max_heap(size_t size);
+void mem_set_huge_pages(int mode);
+int mem_huge_pages(void);
 void mem_init(void);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_max_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_fresh_lo(void);
+
+void *mem_map(size_t size);
+int mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t oldsize, size_t newsize);
+int mem_is_mapped(void *lo, size_t size);
+size_t mem_mapped_bytes(void);
+size_t mem_peak_footprint(void);
+
+size_t mem_purge(void *lo, size_t size);
+size_t mem_resident(void);
 
 #endif
@@ -1,8 +1,16 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef MM_PERCPU
+#include <sys/rseq.h>
+#endif
+#if defined(NT_COPY_MIN) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
  * BEFORE GETTING STARTED:
@@ -23,26 +31,490 @@
 block_t *prologue;
 block_t *epilogue;
 
+// Requests of at most SLAB_MAX bytes are served from runs instead of getting
+// a block of their own. A run is an ordinary allocated block of exactly
+// RUN_SIZE bytes that starts on a RUN_SIZE boundary; its payload holds a
+// run_t followed by equal slots of one size class. Slots carry no tags:
+// mm_free finds the run, and so the size class, from the slot's address
+// through run_map. Runs are 1 KB rather than a full page: a run that is only
+// partly used at the heap's peak is wasted space, and 1 KB keeps that small
+// for the heap sizes the traces reach.
+#define RUN_SHIFT 10
+#define RUN_SIZE ((size_t)1 << RUN_SHIFT)
+#define SLAB_MAX 128
+#define NUM_SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+
+typedef struct run {
+    struct run *next;       // next run of this class with a free slot
+    struct run *prev;       // previous run of this class with a free slot
+    char *free_slots;       // freed slots, linked through their first word
+    uint32_t bump;          // offset of the first slot never handed out
+    uint16_t slot_size;     // size of every slot in the run
+    uint16_t nfree;         // free slots, counting the never-used ones
+} run_t;
+
+// offset of the first slot from the start of the run_t
+#define RUN_HEADER_SIZE ((sizeof(run_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+// number of slots of the given size that fit in a run
+#define RUN_SLOTS(slot_size) \
+    ((RUN_SIZE - WORD_SIZE - RUN_HEADER_SIZE) / (slot_size))
+
+// Requests of at least MMAP_THRESHOLD bytes get pages of their own from
+// mem_map instead of a heap block, and mm_free gives those straight back
+// with mem_unmap; in the heap, a freed buffer that size would leave a hole
+// mem_sbrk could never return. Such blocks are flagged BLOCK_MAPPED. A
+// block mm_memalign maps starts far enough into its first page for the
+// payload to be aligned, and runs to the end of the mapping.
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD ((size_t)1 << 20)
+#endif
+
+// Mapped blocks are never copied when mm_realloc resizes them: mem_remap
+// moves their pages instead. Building with -D NT_COPY_MIN=<bytes> makes it
+// copy heap blocks of that size or more with non-temporal stores, which
+// bypass the cache, so one big move does not evict what the program has
+// cached. Heap blocks stay under MMAP_THRESHOLD, which fits in the L2 cache
+// of current CPUs, where plain memcpy measured faster, so it is off by
+// default.
+
+// Once the free block in front of the epilogue reaches TRIM_THRESHOLD bytes,
+// the heap is shrunk until only TRIM_PAD bytes of it are left free. The gap
+// between the two means a heap that hovers around one size does not call
+// mem_sbrk back and forth on every malloc and free.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD ((size_t)128 << 10)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD ((size_t)32 << 10)
+#endif
+
+// Free blocks of PURGE_THRESHOLD bytes or more that the heap cannot give
+// back, because something is allocated after them, have the pages inside
+// them purged with mem_purge: they stay mapped, but the OS takes the
+// physical memory and hands back zeroed pages when they are next touched.
+// Their tags and links are left alone. A purge costs a system call, and a
+// page fault per page if the memory is used again, so purging waits until
+// memory has sat unused for a while: once PURGE_BATCH bytes of blocks have
+// been freed, a pass over the heap purges the large free blocks that
+// were already free, at the same size, at the previous pass, and marks the
+// rest to be purged next time if they are still free then. A purged block
+// is marked too, so it is not purged twice.
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD ((size_t)64 << 10)
+#endif
+#ifndef PURGE_BATCH
+#define PURGE_BATCH ((size_t)1 << 20)
+#endif
+
+// When no free block fits, mm_malloc grows the heap by more than it needs if
+// the heap keeps running out: a growth within GROW_WINDOW block allocations
+// of the previous one doubles the growth step, starting from GROW_MIN, and
+// any other halves it. The step never passes GROW_MAX, or 1/GROW_FRACTION
+// of the heap, so the unused end of the heap stays a small part of the
+// footprint. GROW_MAX is no more than TRIM_PAD, so heap_trim never gives
+// back what was just grown.
+#ifndef GROW_MIN
+#define GROW_MIN ((size_t)128)
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX ((size_t)32 << 10)
+#endif
+#ifndef GROW_WINDOW
+#define GROW_WINDOW 16
+#endif
+#ifndef GROW_FRACTION
+#define GROW_FRACTION 64
+#endif
+
+// The last GROWERS_TRACKED blocks mm_realloc grew are remembered. When one
+// of them has to move to grow again, it is given slack: its new block is
+// 1/2^SLACK_SHIFT bigger than asked for, up to SLACK_MAX bytes, so the next
+// few reallocs fit in place. The slack is given back as a free block when
+// the block shrinks, when it drops out of the table, and before the heap
+// has to grow.
+#ifndef GROWERS_TRACKED
+#define GROWERS_TRACKED 4
+#endif
+#ifndef SLACK_SHIFT
+#define SLACK_SHIFT 2
+#endif
+#ifndef SLACK_MAX
+#define SLACK_MAX ((size_t)64 << 10)
+#endif
+
+// An arena (see mm_arena_create) hands out memory by bumping a pointer
+// through chunks of ARENA_CHUNK_SIZE bytes, which are ordinary allocated
+// blocks taken from the heap, and frees nothing until it is reset or
+// destroyed, when each chunk goes back as one block. A request of more than
+// a quarter of a chunk gets a chunk of its own, so it does not end the
+// chunk being bumped through early. A reset keeps the chunk being bumped
+// through, so an arena reset after every request that fits in one chunk
+// does not take the heap lock at all. Bigger chunks take the lock less
+// often, but an arena then holds more that it does not use: the one it
+// keeps between requests, and the unused end of the last one.
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE ((size_t)8 << 10)
+#endif
+
+// A pool (see mm_pool_create) hands out objects of one size from slabs,
+// ordinary allocated blocks of POOL_SLAB_SIZE bytes, or of
+// POOL_SLAB_OBJECTS objects if that is more, taken from the heap. Objects
+// carry no tags and are not rounded up to MINBLOCKSIZE. A freed object is
+// pushed onto the pool's free stack, linked through its first word, and
+// mm_pool_alloc pops that before handing out objects the newest slab has
+// not used yet. Slabs go back to the heap when the pool is destroyed.
+// Building with -D MM_POOL_STATS makes pools count the objects in use, for
+// mm_pool_get_stats; that costs a few instructions per call.
+#ifndef POOL_SLAB_SIZE
+#define POOL_SLAB_SIZE ((size_t)16 << 10)
+#endif
+#ifndef POOL_SLAB_OBJECTS
+#define POOL_SLAB_OBJECTS 32
+#endif
+
+// runs with at least one free slot, by size class
+static run_t *avail_runs[NUM_SLAB_CLASSES];
+// bit i is set iff page (run_map_base + i) is a run; lives in a heap block
+static unsigned char *run_map;
+// number of pages run_map covers
+static size_t run_map_pages;
+// page number of the first heap page
+static uintptr_t run_map_base;
+
+// Freed blocks of at most FASTBIN_MAX bytes are not coalesced right away but
+// pushed, still marked allocated, onto a LIFO bin for their exact size, so a
+// free followed by a malloc of the same size is a pop with no split or
+// merge. The bins are consolidated (their blocks really freed) only when a
+// request misses every free list, just before the heap would grow. Not in
+// the TLSF build, whose mm_malloc has to stay bounded-time; -D
+// MM_NO_FASTBINS turns them off elsewhere.
+#if !defined(MM_TLSF) && !defined(MM_NO_FASTBINS)
+#define MM_FASTBINS
+#ifndef FASTBIN_MAX
+#define FASTBIN_MAX 512
+#endif
+#define NUM_FASTBINS (FASTBIN_MAX / ALIGNMENT + 1)
+
+// fast bins by block size / ALIGNMENT, linked through their first payload
+// word
+static block_t *fastbins[NUM_FASTBINS];
+// set when some fast bin may be non-empty
+static int fastbins_nonempty;
+
+// returns the block after b in its fast bin
+static inline block_t *fastbin_next(block_t *b) {
+    block_t *next;
+    memcpy(&next, b->payload, sizeof(next));
+    return next;
+}
+
+// pushes a block onto the fast bin for its size
+static inline void fastbin_push(block_t *b) {
+    size_t bin = block_size(b) / ALIGNMENT;
+    memcpy(b->payload, &fastbins[bin], sizeof(block_t *));
+    fastbins[bin] = b;
+    fastbins_nonempty = 1;
+}
+#endif
+
+// counters reported by mm_get_stats
+static mm_stats_t stats;
+
+// bytes of blocks freed since the last purge pass
+static size_t purge_pending;
+
+// the part of the block block_malloc last handed out that is known to read
+// as zero, because its pages were purged or are fresh from mem_sbrk; empty
+// if zero_lo >= zero_hi
+static char *zero_lo;
+static char *zero_hi;
+
+// adds to the bytes mm_realloc has copied; slots and mapped blocks move
+// without heap_lock, so the counter is updated atomically
+static inline void count_copied(size_t bytes) {
+    __atomic_fetch_add(&stats.realloc_copied, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * copies a payload that mm_realloc moves, with non-temporal stores if it is
+ * at least NT_COPY_MIN bytes (see above), and counts the bytes
+ * arguments: dst: where to copy to
+ *            src: where to copy from; must not overlap dst
+ *            size: the number of bytes to copy
+ * returns: nothing
+ */
+static void copy_payload(void *dst, const void *src, size_t size) {
+    count_copied(size);
+#if defined(NT_COPY_MIN) && defined(__SSE2__)
+    if (size >= NT_COPY_MIN) {
+        char *d = dst;
+        const char *s = src;
+        // streaming stores need a 16-byte aligned destination
+        size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        size -= head;
+        for (; size >= 64; size -= 64, d += 64, s += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *)s);
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+            _mm_stream_si128((__m128i *)d, a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        }
+        // order the streaming stores before anything that follows
+        _mm_sfence();
+        memcpy(d, s, size);
+        return;
+    }
+#endif
+    memcpy(dst, src, size);
+}
+
+// current growth step (see GROW_MIN), block allocations so far, and how many
+// there had been when the heap last grew
+static size_t grow_step;
+static unsigned long block_allocs;
+static unsigned long grow_last;
+
+// a block mm_realloc grew, and the block size it needs without its slack
+typedef struct grower {
+    block_t *block;  // NULL if the entry is unused
+    size_t need;
+} grower_t;
+static grower_t growers[GROWERS_TRACKED];
+// the entry the next grower replaces
+static int growers_next;
+
+// the start of an arena chunk's payload; the rest of the payload is handed
+// out
+typedef struct arena_chunk {
+    struct arena_chunk *next;  // the chunk the arena took before this one
+} arena_chunk_t;
+
+struct mm_arena {
+    arena_chunk_t *chunks;  // chunks to bump through, the current one first
+    arena_chunk_t *big;     // chunks that each hold a single request
+    char *bump;             // the next free byte of the current chunk
+    char *limit;            // the end of the current chunk
+};
+
+struct mm_pool {
+    void *free;       // freed objects, linked through their first word
+    char *bump;       // the next object the newest slab has not handed out
+    char *limit;      // the end of the newest slab's last object
+    size_t obj_size;  // a multiple of align
+    size_t align;
+    void *slabs;      // every slab, linked through its first word
+#ifdef MM_POOL_STATS
+    mm_pool_stats_t stats;
+#endif
+};
+
+// returns 1 if a purge pass has seen the free block b, or purged it, at its
+// current size (see heap_purge)
+static inline int block_purge_seen(block_t *b) {
+    size_t size = block_size(b);
+    size_t mark;
+    if (size < PURGE_THRESHOLD) {
+        return 0;
+    }
+    memcpy(&mark, &b->payload[2], sizeof(mark));
+    return mark == size || mark == (size | 1);
+}
+
+// marks the free block b as seen by a purge pass, so the next one purges it
+static inline void block_set_purge_seen(block_t *b) {
+    if (block_size(b) >= PURGE_THRESHOLD) {
+        size_t mark = block_size(b) | 1;
+        memcpy(&b->payload[2], &mark, sizeof(mark));
+    }
+}
+
+// clears the purge mark of the free block b, which is new or has changed
+// size, so whatever its payload held there is not taken for a mark
+static inline void block_clear_purge_mark(block_t *b) {
+    if (block_size(b) >= PURGE_THRESHOLD) {
+        memset(&b->payload[2], 0, sizeof(size_t));
+    }
+}
+
+// returns 1 if the pages of the free block b have been purged at its
+// current size, so they read as zero past its mark (see heap_purge)
+static inline int block_purged(block_t *b) {
+    size_t size = block_size(b);
+    size_t mark;
+    if (size < PURGE_THRESHOLD) {
+        return 0;
+    }
+    memcpy(&mark, &b->payload[2], sizeof(mark));
+    return mark == size;
+}
+
+// Every heap structure above is only touched with heap_lock held. The one
+// exception is run_map, which mm_free reads without the lock to find out
+// whether a pointer is a slot: a page's bit cannot change while the caller
+// still owns a pointer into it, a grown map is published before its page
+// count, and replaced maps are never freed, so a reader never sees memory
+// that has been reused.
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+// Blocks freed while another thread held heap_lock, linked through their
+// first payload word. Any thread pushes with a compare-and-swap; whoever
+// takes heap_lock next swaps the whole list out and frees it in one batch,
+// so a free never waits for the lock.
+static void *remote_frees;
+// bumped by mm_init, so per-thread caches can tell their slots belong to a
+// heap that has since been thrown away
+static unsigned long heap_generation;
+
+#ifndef MM_NO_TCACHE
+// Each thread keeps up to TCACHE_MAX freed slots per slab class, so a
+// malloc/free pair from one thread usually takes no lock. An empty cache is
+// refilled, and a full one half emptied, TCACHE_BATCH slots at a time under
+// one lock. Building with -D MM_NO_TCACHE takes the lock on every call.
+#define TCACHE_MAX 16
+#define TCACHE_BATCH 8
+
+typedef struct tcache {
+    char *slots[NUM_SLAB_CLASSES];       // cached slots, linked by first word
+    uint16_t count[NUM_SLAB_CLASSES];    // number of slots in each list
+    unsigned long generation;            // heap_generation they came from
+    int registered;                      // thread exit flushes the cache
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Restartable sequences are only wired up for Linux on x86-64; elsewhere a
+// -D MM_PERCPU build behaves like the default one
+#if defined(MM_PERCPU) && !(defined(__linux__) && defined(__x86_64__))
+#undef MM_PERCPU
+#endif
+
+#ifdef MM_PERCPU
+// With -D MM_PERCPU, each CPU rather than each thread keeps up to PCPU_MAX
+// freed slots per slab class, so the memory held in caches is bounded by the
+// number of CPUs however many threads there are. A cache is only changed
+// inside a restartable sequence (rseq) that the kernel aborts if the thread
+// is preempted or migrated before its final store, so neither a lock nor an
+// atomic instruction is needed. If glibc has not registered rseq for the
+// process (e.g. GLIBC_TUNABLES=glibc.pthread.rseq=0), mm_init falls back to
+// per-thread caches.
+#define PCPU_MAX 16
+#define PCPU_BATCH 8
+
+typedef struct pcpu_cache {
+    uint64_t count[NUM_SLAB_CLASSES];              // slots in each stack
+    char *slots[NUM_SLAB_CLASSES][PCPU_MAX];       // cached slots
+} pcpu_cache_t;
+
+// one cache per configured CPU, kept in a heap block
+static pcpu_cache_t *pcpu_caches;
+static int pcpu_count;
+#endif
+
+// MM_CACHE_CPU, MM_CACHE_THREAD or MM_CACHE_NONE, chosen by mm_init
+static int cache_mode;
+
+#ifdef MM_PERCPU
+// mm_init allocates the per-CPU caches
+static void *block_malloc(size_t size);
+#endif
+
 /*
  *
  * coalesces neighboring free blocks
  * arguments: my current free block
- * returns: void method, but will merge free blocks if neighboring
+ * returns: the free block it ends up part of, after merging free blocks if
+ *          neighboring
  */
-void coalesce(block_t *myBlock) {
-    block_t *previousBlock = block_prev(myBlock);
-    block_t *nextBlock = block_next(myBlock);
+block_t *coalesce(block_t *myBlock) {
+    // the merged block may change size class, so take it off its list
+    // while its neighbors are absorbed and put it back at the end
+    pull_free_block(myBlock);
     // if next block is free
     if (block_next_allocated(myBlock) == 0) {
+        block_t *nextBlock = block_next(myBlock);
+        stats.coalesces++;
         pull_free_block(nextBlock);
         block_set_size(myBlock, (block_size(nextBlock) + block_size(myBlock)));
     }
     // if previous block is free
     if (block_prev_allocated(myBlock) == 0) {
-        pull_free_block(myBlock);
+        block_t *previousBlock = block_prev(myBlock);
+        stats.coalesces++;
+        pull_free_block(previousBlock);
         block_set_size(previousBlock,
                        (block_size(previousBlock) + block_size(myBlock)));
+        myBlock = previousBlock;
+    }
+    // the block is new or has changed size, so any mark it carries is stale
+    block_clear_purge_mark(myBlock);
+    insert_free_block(myBlock);
+    return myBlock;
+}
+
+/*
+ * finds a free block of at least the given size
+ * arguments: size: the full block size needed (payload plus tags)
+ * returns: a free block that fits, or NULL if no free list has one
+ */
+static block_t *find_free_block(size_t size) {
+#ifdef MM_TLSF
+    // every block in the list for the rounded-up size fits, so this is a
+    // constant-time lookup rather than a search
+    int class = flist_next_nonempty(size_class(fit_size(size)));
+    if (class >= 0) {
+        return flist_first[class];
     }
+    // rounding up skips blocks that are only just big enough; the head of
+    // the request's own list and the block in front of the epilogue are two
+    // cheap places to still find one
+    block_t *freeBlock = flist_first[size_class(size)];
+    if (freeBlock != NULL && block_size(freeBlock) >= size) {
+        return freeBlock;
+    }
+    if (block_prev_allocated(epilogue) == 0 &&
+        block_prev_size(epilogue) >= size) {
+        return block_prev(epilogue);
+    }
+#else
+#ifdef MM_FTREE
+    // large blocks only live in the tree, which gives the best fit directly
+    if (size >= TREE_MIN_SIZE) {
+        return tree_find(size);
+    }
+#endif
+    int class = size_class(size);
+    // the request's own list also holds blocks smaller than it, so it has to
+    // be searched first-fit
+    block_t *freeBlock = flist_first[class];
+    if (freeBlock != NULL) {
+        do {
+            if (block_size(freeBlock) >= size) {
+                return freeBlock;
+            }
+            freeBlock = block_flink(freeBlock);
+        } while (freeBlock != flist_first[class]);
+    }
+    // any block in a larger, non-empty list fits, so take its head
+    if (class + 1 < NUM_FREE_LISTS &&
+        (class = flist_next_nonempty(class + 1)) >= 0) {
+        return flist_first[class];
+    }
+#ifdef MM_FTREE
+    // every block in the tree fits, so take the smallest
+    if (ftree_root != NULL) {
+        return tree_find(size);
+    }
+#endif
+#endif
+    return NULL;
 }
 
 // rounds up to the nearest multiple of WORD_SIZE
@@ -50,6 +522,14 @@ static inline size_t align(size_t size) {
     return (((size) + (WORD_SIZE - 1)) & ~(WORD_SIZE - 1));
 }
 
+// returns the size of the block needed for a payload of the given size:
+// an allocated block only carries its header, but it must still be big
+// enough to become a free block later
+static inline size_t block_size_for(size_t size) {
+    size_t blockSize = align(size) + WORD_SIZE;
+    return blockSize < MINBLOCKSIZE ? MINBLOCKSIZE : blockSize;
+}
+
 /*
  *                             _       _ _
  *     _ __ ___  _ __ ___     (_)_ __ (_) |_
@@ -58,7 +538,9 @@ static inline size_t align(size_t size) {
  *    |_| |_| |_|_| |_| |_|___|_|_| |_|_|\__|
  *                       |_____|
  *
- * initializes the dynamic storage allocator (allocate initial heap space)
+ * initializes the dynamic storage allocator (allocate initial heap space).
+ * Must not run while other threads are inside mm_ calls; slots still cached
+ * by threads from an earlier heap are dropped the next time they use it.
  * arguments: none
  * returns: 0, if successful
  *         -1, if an error occurs
@@ -73,338 +555,2013 @@ int mm_init(void) {
         fprintf(stderr, "mem_sbrk");
         return -1;
     }
-    // sets block size and allocation
+    // sets block size and allocation; nothing comes before the prologue, so
+    // it is marked as following an allocated block
+    block_set_prev_allocated(prologue, 1);
     block_set_size_and_allocated(prologue, TAGS_SIZE, 1);
     block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
-    flist_first = NULL;
+    flist_reset();
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) {
+        avail_runs[i] = NULL;
+    }
+    run_map = NULL;
+    run_map_pages = 0;
+    run_map_base = (uintptr_t)mem_heap_lo() >> RUN_SHIFT;
+    heap_generation++;
+    remote_frees = NULL;
+#ifdef MM_FASTBINS
+    for (int i = 0; i < NUM_FASTBINS; i++) {
+        fastbins[i] = NULL;
+    }
+    fastbins_nonempty = 0;
+#endif
+    memset(&stats, 0, sizeof(stats));
+    purge_pending = 0;
+    grow_step = GROW_MIN;
+    block_allocs = 0;
+    grow_last = 0;
+    memset(growers, 0, sizeof(growers));
+    growers_next = 0;
+#ifdef MM_NO_TCACHE
+    cache_mode = MM_CACHE_NONE;
+#else
+    cache_mode = MM_CACHE_THREAD;
+#endif
+#ifdef MM_PERCPU
+    pcpu_caches = NULL;
+    if (__rseq_size > 0) {
+        pcpu_count = (int)sysconf(_SC_NPROCESSORS_CONF);
+        if (pcpu_count > 0 &&
+            (pcpu_caches = block_malloc(pcpu_count * sizeof(pcpu_cache_t))) !=
+                NULL) {
+            memset(pcpu_caches, 0, pcpu_count * sizeof(pcpu_cache_t));
+            cache_mode = MM_CACHE_CPU;
+        }
+    }
+#endif
     return 0;
 }
 
-/*     _ __ ___  _ __ ___      _ __ ___   __ _| | | ___   ___
- *    | '_ ` _ \| '_ ` _ \    | '_ ` _ \ / _` | | |/ _ \ / __|
- *    | | | | | | | | | | |   | | | | | | (_| | | | (_) | (__
- *    |_| |_| |_|_| |_| |_|___|_| |_| |_|\__,_|_|_|\___/ \___|
- *                       |_____|
- *
- * allocates a block of memory and returns a pointer to that block's payload
- * arguments: size: the desired payload size for the block
- * returns: a pointer to the newly-allocated block's payload (whose size
- *          is a multiple of ALIGNMENT), or NULL if an error occurred
+#ifdef MM_FASTBINS
+/*
+ * frees every block in the fast bins for real, coalescing each with its
+ * neighbors
+ * arguments: none
+ * returns: nothing
  */
-void *mm_malloc(size_t size) {
-    // TODO
-    if (size <= 0) {
-        fprintf(stderr, "size is 0 or below");
-        return NULL;
-    }
-    // align the size at the beginning to avoid any weird errors
-    size_t minimumSize = 24;
-    size_t alignedSize = align(size);
-    size_t newBlockSize = (alignedSize + TAGS_SIZE);
-    block_t *freeBlock;
-    freeBlock = flist_first;
-    // loop through free list
-    while (flist_first != NULL) {
-        size_t freeBlockSize = block_size(freeBlock);
-        // size_t freeBlockPayload = block_size(freeBlock)-(TAGS_SIZE);
-        if (freeBlockSize >= newBlockSize) {
-            // make sure that split block will then be >= minimum size or will
-            // fit exactly leftover size of block must be at least big enough to
-            // fit the tags and wordsize (24 bytes)
-            size_t leftOverSize = freeBlockSize - newBlockSize;
-            // perfect size
-            if (leftOverSize == 0) {
-                pull_free_block(freeBlock);
-                block_set_size_and_allocated(freeBlock, newBlockSize, 1);
-                return &freeBlock->payload[0];
-            }
-            // able to split
-            else if (leftOverSize >= minimumSize) {
-                pull_free_block(freeBlock);
-                block_set_size_and_allocated(freeBlock, newBlockSize, 1);
-                block_t *splitBlock = block_next(freeBlock);
-                // size_t alignedLeftoverSize = align(leftOverSize-TAGS_SIZE);
-                block_set_size_and_allocated(splitBlock, leftOverSize, 0);
-
-                // pull_free_block(splitBlock);
-                insert_free_block(splitBlock);
-                coalesce(splitBlock);
-                return &freeBlock->payload[0];
-            }
-            // cannot split, then will take up the entire free block
-            else {
-                pull_free_block(freeBlock);
-                block_set_size_and_allocated(freeBlock, freeBlockSize, 1);
-                return &freeBlock->payload[0];
-            }
-        }
-        // if I have looped through the entire free list, then break
-        if (block_flink(freeBlock) == flist_first) {
-            break;
+static void fastbins_consolidate(void) {
+    for (int i = 0; i < NUM_FASTBINS; i++) {
+        block_t *fastBlock = fastbins[i];
+        fastbins[i] = NULL;
+        while (fastBlock != NULL) {
+            block_t *next = fastbin_next(fastBlock);
+            block_set_allocated(fastBlock, 0);
+            insert_free_block(fastBlock);
+            coalesce(fastBlock);
+            fastBlock = next;
         }
-        freeBlock = block_flink(freeBlock);
     }
+    fastbins_nonempty = 0;
+    stats.consolidations++;
+}
+#endif
 
-    if (block_prev_allocated(epilogue) == 0) {
-        block_t *previousFreeBlock = block_prev(epilogue);
-        block_t *newBlock;
-        size_t sizeToExtend = newBlockSize - block_size(previousFreeBlock);
-        if ((newBlock = mem_sbrk(sizeToExtend)) == (void *)-1) {
-            fprintf(stderr, "mem_sbrk");
-            return (void *)-1;
+/*
+ * grows the heap with mem_sbrk, counting the call
+ * arguments: size: how many bytes to grow the heap by
+ * returns: the start of the new space, or (void *)-1 if the heap cannot grow
+ */
+static void *heap_extend(size_t size) {
+    stats.sbrks++;
+    return mem_sbrk((intptr_t)size);
+}
+
+/*
+ * picks how far to grow the heap when it is need bytes short, and updates
+ * the growth step (see GROW_MIN)
+ * arguments: need: the least the heap has to grow by
+ * returns: need, or the growth step if that is bigger by at least
+ *          MINBLOCKSIZE, so the rest can become a free block
+ */
+static size_t heap_grow_size(size_t need) {
+    if (block_allocs - grow_last <= GROW_WINDOW) {
+        grow_step = grow_step * 2 < GROW_MAX ? grow_step * 2 : GROW_MAX;
+    } else {
+        grow_step = grow_step / 2 > GROW_MIN ? grow_step / 2 : GROW_MIN;
+    }
+    grow_last = block_allocs;
+    size_t step = grow_step;
+    size_t cap = align(mem_heapsize() / GROW_FRACTION);
+    if (step > cap) {
+        step = cap > GROW_MIN ? cap : GROW_MIN;
+    }
+    return step >= need + MINBLOCKSIZE ? step : need;
+}
+
+// returns the entry of a block mm_realloc grew recently, or NULL
+static inline grower_t *grower_find(block_t *b) {
+    for (int i = 0; i < GROWERS_TRACKED; i++) {
+        if (growers[i].block == b) {
+            return &growers[i];
         }
-        // reset the address of my new block to behind the epilogue
-        newBlock = (block_t *)((char *)newBlock - block_size(epilogue));
+    }
+    return NULL;
+}
 
-        block_set_size_and_allocated(newBlock, sizeToExtend, 0);
-        insert_free_block(newBlock);
-        // move epilogue foward
-        epilogue = (block_t *)((char *)epilogue + block_size(newBlock));
-        block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
-        coalesce(previousFreeBlock);
-        pull_free_block(previousFreeBlock);
-        // set previous free block
-        block_set_size_and_allocated(previousFreeBlock, newBlockSize, 1);
+// returns how much slack a growing block of the given size gets
+static inline size_t slack_for(size_t size) {
+    size_t slack = align(size >> SLACK_SHIFT);
+    return slack < SLACK_MAX ? slack : SLACK_MAX;
+}
+
+/*
+ * cuts a block mm_realloc grew back to the size it needs, freeing its
+ * slack, and forgets it
+ * arguments: g: the block's entry
+ * returns: nothing
+ */
+static void grower_release(grower_t *g) {
+    block_t *b = g->block;
+    size_t size = block_size(b);
+    g->block = NULL;
+    if (size - g->need >= MINBLOCKSIZE) {
+        stats.splits++;
+        block_set_size(b, g->need);
+        block_t *slackBlock = block_next(b);
+        block_set_size_and_allocated(slackBlock, size - g->need, 0);
+        insert_free_block(slackBlock);
+        coalesce(slackBlock);
+    }
+}
 
-        return &previousFreeBlock->payload[0];
+/*
+ * remembers a block mm_realloc grew, in place of the oldest entry, whose
+ * slack is given back
+ * arguments: b: the block
+ *            need: the block size it needs without slack
+ * returns: the block's entry
+ */
+static grower_t *grower_add(block_t *b, size_t need) {
+    grower_t *g = &growers[growers_next];
+    growers_next = (growers_next + 1) % GROWERS_TRACKED;
+    if (g->block != NULL) {
+        grower_release(g);
     }
+    g->block = b;
+    g->need = need;
+    return g;
+}
 
-    size_t extraAlignedSize = 128;
+// gives back the slack of every block mm_realloc grew; returns 1 if any of
+// them had some
+static int growers_release_all(void) {
+    int released = 0;
+    for (int i = 0; i < GROWERS_TRACKED; i++) {
+        if (growers[i].block != NULL) {
+            released |= block_size(growers[i].block) > growers[i].need;
+            grower_release(&growers[i]);
+        }
+    }
+    return released;
+}
 
-    // if chunk size is greater than precise size
-    if (extraAlignedSize > newBlockSize) {
-        if ((extraAlignedSize - newBlockSize) >= (int)MINBLOCKSIZE) {
-            // now check for extending the heap
-            block_t *newBlock;
-            if ((newBlock = mem_sbrk(extraAlignedSize)) == (void *)-1) {
-                fprintf(stderr, "mem_sbrk");
-                return (void *)-1;
+/*
+ * allocates a block (never a slot) of memory
+ * arguments: size: the desired payload size for the block
+ * returns: a pointer to the newly-allocated block's payload, or NULL if the
+ *          heap cannot grow
+ */
+static void *block_malloc(size_t size) {
+    // align the size at the beginning to avoid any weird errors
+    size_t minimumSize = MINBLOCKSIZE;
+    size_t newBlockSize = block_size_for(size);
+    block_allocs++;
+    zero_lo = zero_hi = NULL;
+#ifdef MM_FASTBINS
+    if (newBlockSize <= FASTBIN_MAX &&
+        fastbins[newBlockSize / ALIGNMENT] != NULL) {
+        block_t *fastBlock = fastbins[newBlockSize / ALIGNMENT];
+        fastbins[newBlockSize / ALIGNMENT] = fastbin_next(fastBlock);
+        stats.fastbin_hits++;
+        return &fastBlock->payload[0];
+    }
+#endif
+    block_t *freeBlock = find_free_block(newBlockSize);
+#ifdef MM_FASTBINS
+    // merge what the fast bins hold before growing the heap
+    if (freeBlock == NULL && fastbins_nonempty) {
+        fastbins_consolidate();
+        freeBlock = find_free_block(newBlockSize);
+    }
+#endif
+    // and take back the slack of growing blocks
+    if (freeBlock == NULL && growers_release_all()) {
+        freeBlock = find_free_block(newBlockSize);
+    }
+    if (freeBlock != NULL) {
+        size_t freeBlockSize = block_size(freeBlock);
+        if (block_purged(freeBlock)) {
+            // the whole pages heap_purge gave back read as zero
+            uintptr_t pageSize = (uintptr_t)mem_pagesize();
+            uintptr_t lo = (uintptr_t)&freeBlock->payload[2] + sizeof(size_t);
+            zero_lo = (char *)((lo + pageSize - 1) & ~(pageSize - 1));
+            zero_hi = (char *)((uintptr_t)block_end_tag(freeBlock) &
+                               ~(pageSize - 1));
+        }
+        // make sure that split block will then be >= minimum size or will
+        // fit exactly leftover size of block must be at least big enough to
+        // fit the tags and both links (MINBLOCKSIZE)
+        size_t leftOverSize = freeBlockSize - newBlockSize;
+        // perfect size
+        if (leftOverSize == 0) {
+            pull_free_block(freeBlock);
+            block_set_size_and_allocated(freeBlock, newBlockSize, 1);
+            return &freeBlock->payload[0];
+        }
+        // able to split
+        else if (leftOverSize >= minimumSize) {
+            stats.splits++;
+            int seen = block_purge_seen(freeBlock);
+            pull_free_block(freeBlock);
+            block_set_size_and_allocated(freeBlock, newBlockSize, 1);
+            block_t *splitBlock = block_next(freeBlock);
+            block_set_size_and_allocated(splitBlock, leftOverSize, 0);
+            insert_free_block(splitBlock);
+            splitBlock = coalesce(splitBlock);
+            if (seen && block_size(splitBlock) == leftOverSize) {
+                // what is left has been free as long as the whole block was
+                block_set_purge_seen(splitBlock);
             }
-            // reset the address of my new block to behind the epilogue
-            newBlock = (block_t *)((char *)newBlock - block_size(epilogue));
-            // set block as huge free block
-            block_set_size_and_allocated(newBlock, extraAlignedSize, 1);
-            // move epilogue foward
-            epilogue = (block_t *)((char *)epilogue + block_size(newBlock));
-            block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
-            // now focus on splitting the new block
-            block_set_size(newBlock, newBlockSize);
-
-            block_t *extraSpaceBlock = block_next(newBlock);
-            block_set_size_and_allocated(extraSpaceBlock,
-                                         extraAlignedSize - newBlockSize, 0);
-            insert_free_block(extraSpaceBlock);
-            coalesce(extraSpaceBlock);
-            return &newBlock->payload[0];
+            return &freeBlock->payload[0];
+        }
+        // cannot split, then will take up the entire free block
+        else {
+            pull_free_block(freeBlock);
+            block_set_size_and_allocated(freeBlock, freeBlockSize, 1);
+            return &freeBlock->payload[0];
         }
     }
 
-    // now check for extending the heap
-    block_t *newBlock;
-    if ((newBlock = mem_sbrk(newBlockSize)) == (void *)-1) {
+    // grow the heap after the last block, extending it if it is free (every
+    // free block is smaller than the request at this point, so the heap only
+    // has to grow by the difference)
+    block_t *newBlock = epilogue;
+    size_t lastSize = 0;
+    if (block_prev_allocated(epilogue) == 0) {
+        newBlock = block_prev(epilogue);
+        lastSize = block_size(newBlock);
+    }
+    size_t growSize = heap_grow_size(newBlockSize - lastSize);
+    char *fresh = mem_fresh_lo();
+    char *oldBrk = heap_extend(growSize);
+    if (oldBrk == (void *)-1) {
         fprintf(stderr, "mem_sbrk");
-        return (void *)-1;
-    }
-    // reset the address of my new block to behind the epilogue
-    newBlock = (block_t *)((char *)newBlock - block_size(epilogue));
-    // set block as huge free block
-    block_set_size_and_allocated(newBlock, (newBlockSize), 1);
-    // move epilogue foward
-    epilogue = (block_t *)((char *)epilogue + block_size(newBlock));
+        return NULL;
+    }
+    // the new space reads as zero unless an earlier, bigger heap wrote it
+    zero_lo = oldBrk > fresh ? oldBrk : fresh;
+    zero_hi = oldBrk + growSize;
+    if (lastSize != 0) {
+        pull_free_block(newBlock);
+    }
+    size_t totalSize = lastSize + growSize;
+    // move epilogue foward (before newBlock is written, since newBlock may
+    // take over the old epilogue's header)
+    epilogue = (block_t *)((char *)newBlock + totalSize);
+    block_set_size_and_allocated(newBlock, totalSize, 1);
     block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
-
+    // what was grown beyond the request is left free at the end of the heap
+    if (totalSize > newBlockSize) {
+        block_set_size(newBlock, newBlockSize);
+        block_t *extraSpaceBlock = block_next(newBlock);
+        block_set_size_and_allocated(extraSpaceBlock, totalSize - newBlockSize,
+                                     0);
+        block_clear_purge_mark(extraSpaceBlock);
+        insert_free_block(extraSpaceBlock);
+    }
     return &newBlock->payload[0];
 }
 
-/*                              __
- *     _ __ ___  _ __ ___      / _|_ __ ___  ___
- *    | '_ ` _ \| '_ ` _ \    | |_| '__/ _ \/ _ \
- *    | | | | | | | | | | |   |  _| | |  __/  __/
- *    |_| |_| |_|_| |_| |_|___|_| |_|  \___|\___|
- *                       |_____|
- *
- * frees a block of memory, enabling it to be reused later
- * arguments: ptr: pointer to the block's payload
+/*
+ * gives the end of the heap back with mem_sbrk if the free block in front of
+ * the epilogue has grown past TRIM_THRESHOLD, keeping TRIM_PAD bytes of it
+ * arguments: none
  * returns: nothing
  */
-void mm_free(void *ptr) {
-    if (ptr != NULL) {
-        block_t *myFreeBlock = payload_to_block(ptr);
-        block_set_allocated(myFreeBlock, 0);
-        insert_free_block(myFreeBlock);
-        coalesce(myFreeBlock);
+static void heap_trim(void) {
+    if (block_prev_allocated(epilogue)) {
+        return;
+    }
+    block_t *lastBlock = block_prev(epilogue);
+    size_t lastSize = block_size(lastBlock);
+    if (lastSize < TRIM_THRESHOLD) {
+        return;
     }
+    // the block keeps its place in the heap but changes size class
+    pull_free_block(lastBlock);
+    block_set_size(lastBlock, TRIM_PAD);
+    insert_free_block(lastBlock);
+    // move epilogue back
+    epilogue = block_next(lastBlock);
+    block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
+    mem_sbrk(-(intptr_t)(lastSize - TRIM_PAD));
+    stats.trims++;
 }
 
 /*
- *                                            _ _
- *     _ __ ___  _ __ ___      _ __ ___  __ _| | | ___   ___
- *    | '_ ` _ \| '_ ` _ \    | '__/ _ \/ _` | | |/ _ \ / __|
- *    | | | | | | | | | | |   | | |  __/ (_| | | | (_) | (__
- *    |_| |_| |_|_| |_| |_|___|_|  \___|\__,_|_|_|\___/ \___|
- *                       |_____|
- *
- * reallocates a memory block to update it with a new given size
- * arguments: ptr: a pointer to the memory block's payload
- *            size: the desired new payload size
- * returns: a pointer to the new memory block's payload
+ * frees a block (never a slot), coalescing it with its neighbors, or puts
+ * it in a fast bin if it is small
+ * arguments: ptr: pointer to the block's payload
+ * returns: the free block it ends up part of, or NULL if it went to a fast
+ *          bin
  */
-void *mm_realloc(void *ptr, size_t size) {
-    // TODO
-    // edge cases
-    if (ptr == NULL) {
-        return mm_malloc(size);
+static block_t *block_free(void *ptr) {
+    block_t *myFreeBlock = payload_to_block(ptr);
+    grower_t *grower = grower_find(myFreeBlock);
+    if (grower != NULL) {
+        grower->block = NULL;
     }
-
-    if (size == 0) {
+#ifdef MM_FASTBINS
+    if (block_size(myFreeBlock) <= FASTBIN_MAX) {
+        fastbin_push(myFreeBlock);
         return NULL;
     }
-    // keeping tracks of sizes
-    size_t newAlignedSize = align(size);
-    size_t requestedSize = newAlignedSize + TAGS_SIZE;
-    block_t *myBlock = payload_to_block(ptr);
-    size_t originalSize = block_size(myBlock);
-    size_t availableSpace = originalSize;
-
-    // if I am shrinking, then can coalesce if minimum size is not found, if no
-    // free blocks and not minimum size then don't do anything
-    if (requestedSize < originalSize) {
-        // check for surrounding free blocks
-        // check next block is free
-        if (block_next_allocated(myBlock) == 0) {
-            availableSpace = availableSpace + block_next_size(myBlock);
-            // set sizing
-            pull_free_block(block_next(myBlock));
-            block_set_size_and_allocated(myBlock, requestedSize, 1);
-            block_t *splitBlock = block_next(myBlock);
-            block_set_size_and_allocated(splitBlock,
-                                         (availableSpace - requestedSize), 0);
-            insert_free_block(splitBlock);
-            coalesce(splitBlock);
-            // set surrounding block size
-            block_set_size(block_prev(myBlock), block_prev_size(myBlock));
-            block_set_size_and_allocated(myBlock, (requestedSize), 1);
-            block_set_size(block_next(myBlock), block_next_size(myBlock));
-            return &myBlock->payload[0];
-        } else if (block_prev_allocated(myBlock) == 0) {
-            availableSpace = availableSpace + block_prev_size(myBlock);
-            block_t *previousBlock = block_prev(myBlock);
-            // set sizing
-            pull_free_block(previousBlock);
-            block_set_size_and_allocated(previousBlock,
-                                         availableSpace - requestedSize, 0);
-            block_t *splitBlock = block_next(previousBlock);
-            block_set_size_and_allocated(splitBlock, (requestedSize), 1);
-            insert_free_block(previousBlock);
-            coalesce(previousBlock);
-            // set surrounding block size
-            block_set_size(block_prev(splitBlock), block_prev_size(splitBlock));
-            block_set_size_and_allocated(splitBlock, (requestedSize), 1);
-            block_set_size(block_next(splitBlock), block_next_size(splitBlock));
-            return &splitBlock->payload[0];
-        }
-        // if no free block is found
-        else {
-            // check to see if shrinking will cause less than minimum size, then
-            // do nothing
-            if (((int)availableSpace - (int)requestedSize) <
-                (int)MINBLOCKSIZE) {
-                // set sizing
-                block_set_size_and_allocated(myBlock, originalSize, 1);
-                return &myBlock->payload[0];
-            } else {
-                block_set_size_and_allocated(myBlock, requestedSize, 1);
-                block_t *splitBlock = block_next(myBlock);
-                block_set_size_and_allocated(
-                    splitBlock, (availableSpace - requestedSize), 0);
-                insert_free_block(splitBlock);
-                coalesce(splitBlock);
-                // set surrounding block size
-                block_set_size(block_prev(myBlock), block_prev_size(myBlock));
-                block_set_size_and_allocated(myBlock, (requestedSize), 1);
-                block_set_size(block_next(myBlock), block_next_size(myBlock));
-                return &myBlock->payload[0];
+#endif
+    block_set_allocated(myFreeBlock, 0);
+    insert_free_block(myFreeBlock);
+    return coalesce(myFreeBlock);
+}
+
+/*
+ * purges the pages inside every free block of at least PURGE_THRESHOLD
+ * bytes that has been free, and the same size, since the last pass
+ * arguments: none
+ * returns: nothing
+ */
+static void heap_purge(void) {
+    for (block_t *b = block_next(prologue); b != epilogue; b = block_next(b)) {
+        size_t size = block_size(b);
+        if (block_allocated(b) || size < PURGE_THRESHOLD) {
+            continue;
+        }
+        // the word after the links is size | 1 once a pass has seen the
+        // block, and size once its pages are purged; anything else means it
+        // is new since the last pass (sizes are multiples of 8, so the two
+        // can't be confused)
+        size_t mark;
+        memcpy(&mark, &b->payload[2], sizeof(mark));
+        if (mark == (size | 1)) {
+            // leave the header, the links, the mark and the end tag
+            char *lo = (char *)&b->payload[2] + sizeof(mark);
+            // mm_calloc trusts a purged mark, so only set it if the pages
+            // really were given back
+            if (mem_purge(lo, (size_t)((char *)block_end_tag(b) - lo)) != 0) {
+                mark = size;
+                stats.purges++;
             }
+        } else if (mark != size) {
+            mark = size | 1;
         }
+        memcpy(&b->payload[2], &mark, sizeof(mark));
     }
-    // else if requested > original size
-    if ((int)requestedSize > (int)originalSize) {
-        ////check for surrounding free blocks
-        if (block_next_allocated(myBlock) == 0) {
-            availableSpace = availableSpace + block_next_size(myBlock);
+    purge_pending = 0;
+}
 
-            if (((int)availableSpace - (int)requestedSize) >=
-                (int)MINBLOCKSIZE) {
-                // now reallocate and coalesce
-                block_t *nextBlock = block_next(myBlock);
-                pull_free_block(nextBlock);
-                block_set_size_and_allocated(myBlock, requestedSize, 1);
-                block_t *splitBlock = block_next(myBlock);
-                block_set_size_and_allocated(
-                    splitBlock, (availableSpace - requestedSize), 0);
-                insert_free_block(splitBlock);
-                coalesce(splitBlock);
-                block_set_size_and_allocated(myBlock, requestedSize, 1);
-                block_set_size_and_allocated(
-                    splitBlock, (availableSpace - requestedSize), 0);
-                // set surrounding block size
-                block_set_size(block_prev(myBlock), block_prev_size(myBlock));
-                block_set_size(block_next(myBlock), block_next_size(myBlock));
-
-                return &myBlock->payload[0];
-            }
-            // if minimblock size is not met but we have the room, then
-            // reallocate all of it
-            else if (((int)availableSpace - (int)requestedSize) <
-                         (int)MINBLOCKSIZE &&
-                     ((int)availableSpace - (int)requestedSize) >= 0) {
-                pull_free_block(block_next(myBlock));
-                block_set_size_and_allocated(myBlock, availableSpace, 1);
-
-                // set surrounding block size
-                block_set_size(block_prev(myBlock), block_prev_size(myBlock));
-                block_set_size(block_next(myBlock), block_next_size(myBlock));
-                return &myBlock->payload[0];
+/*
+ * allocates a block in a mapping of its own
+ * arguments: size: the desired payload size
+ *            alignment: a power of two from ALIGNMENT up to the page size
+ * returns: a pointer to the payload, or NULL if the mapping failed
+ */
+static void *mapped_malloc(size_t size, size_t alignment) {
+    size_t pageSize = mem_pagesize();
+    size_t offset = alignment - WORD_SIZE;
+    if (alignment <= WORD_SIZE) {
+        offset = 0;
+    }
+    size_t mapSize =
+        (offset + size + WORD_SIZE + pageSize - 1) & ~(pageSize - 1);
+    if (mapSize < size) {
+        return NULL;
+    }
+    char *base = mem_map(mapSize);
+    if (base == (void *)-1) {
+        return NULL;
+    }
+    // a mapped block has no neighbors, so it never takes part in coalescing
+    block_t *myBlock = (block_t *)(base + offset);
+    myBlock->size = (mapSize - offset) | BLOCK_MAPPED | BLOCK_PREV_ALLOCATED |
+                    BLOCK_ALLOCATED;
+    return &myBlock->payload[0];
+}
+
+// returns the start of the mapping the mapped block b lies in, which is b
+// itself unless mm_memalign aligned it
+static inline char *mapped_base(block_t *b) {
+    return (char *)((uintptr_t)b & ~(uintptr_t)(mem_pagesize() - 1));
+}
+
+// returns the first address at or after ptr that is offset bytes past a
+// multiple of alignment and leaves either no gap or room for a free block in
+// front of it
+static inline char *aligned_payload(char *ptr, size_t alignment,
+                                    size_t offset) {
+    char *aligned =
+        (char *)((((uintptr_t)ptr - offset + alignment - 1) &
+                  ~(uintptr_t)(alignment - 1)) +
+                 offset);
+    // an alignment below MINBLOCKSIZE may take more than one step
+    while (aligned != ptr && (size_t)(aligned - ptr) < MINBLOCKSIZE) {
+        aligned += alignment;
+    }
+    return aligned;
+}
+
+/*
+ * finds a free block that can hold a block of the given size whose payload
+ * is aligned, so aligned requests reuse freed aligned blocks instead of
+ * always growing the heap. Walks every list that may fit, so it is only
+ * meant for rare requests such as new runs; the tree is only asked for its
+ * best fit and for a block big enough to fit whatever the alignment. The
+ * TLSF build does not walk at all, so slab refills stay bounded there too.
+ * arguments: size: the full block size needed (payload plus tags)
+ *            alignment: a power of two, at least ALIGNMENT
+ *            offset: how far past a multiple of alignment the payload sits
+ * returns: a free block that fits, or NULL if there is none
+ */
+static block_t *find_aligned_block(size_t size, size_t alignment,
+                                   size_t offset) {
+#ifdef MM_TLSF
+    // the first list that fits the bare size may still hold a block that
+    // happens to be aligned well enough; only its head is looked at
+    int class = flist_next_nonempty(size_class(fit_size(size)));
+    if (class >= 0) {
+        block_t *freeBlock = flist_first[class];
+        char *aligned = aligned_payload((char *)&freeBlock->payload[0],
+                                        alignment, offset);
+        if (aligned + size - WORD_SIZE <=
+            (char *)freeBlock + block_size(freeBlock)) {
+            return freeBlock;
+        }
+    }
+    // otherwise ask for room for the worst-case slack in front of the
+    // payload, so the constant-time lookup's block fits however it is aligned
+    return find_free_block(size + alignment + MINBLOCKSIZE);
+#else
+    for (int class = flist_next_nonempty(size_class(size)); class >= 0;
+         class = class + 1 < NUM_FREE_LISTS ? flist_next_nonempty(class + 1)
+                                            : -1) {
+        block_t *freeBlock = flist_first[class];
+        do {
+            char *aligned = aligned_payload((char *)&freeBlock->payload[0],
+                                            alignment, offset);
+            if (aligned + size - WORD_SIZE <=
+                (char *)freeBlock + block_size(freeBlock)) {
+                return freeBlock;
             }
-            // if no space then loop through and find free block
-            else {
-                void *newPtr = mm_malloc(size);
-                block_t *newMallocBlock = payload_to_block(newPtr);
-                // preserve memory
-                memmove(newPtr, ptr, originalSize - TAGS_SIZE);
-                mm_free(ptr);
-
-                // set surrounding block size
-                block_set_size(block_prev(newMallocBlock),
-                               block_prev_size(newMallocBlock));
-                block_set_size_and_allocated(newMallocBlock,
-                                             block_size(newMallocBlock), 1);
-                block_set_size(block_next(newMallocBlock),
-                               block_next_size(newMallocBlock));
-                return &newMallocBlock->payload[0];
+            freeBlock = block_flink(freeBlock);
+        } while (freeBlock != flist_first[class]);
+    }
+#ifdef MM_FTREE
+    // the best fit for the bare size may be misaligned, but any block with
+    // room for the worst-case slack in front of the payload fits
+    size_t sizes[2] = {size, size + alignment + MINBLOCKSIZE};
+    for (int i = 0; i < 2; i++) {
+        block_t *freeBlock = tree_find(sizes[i]);
+        if (freeBlock != NULL) {
+            char *aligned = aligned_payload((char *)&freeBlock->payload[0],
+                                            alignment, offset);
+            if (aligned + size - WORD_SIZE <=
+                (char *)freeBlock + block_size(freeBlock)) {
+                return freeBlock;
             }
         }
-        // loop through free list
-        else {
-            void *newPtr = mm_malloc(size);
-            block_t *newMallocBlock = payload_to_block(newPtr);
-            // preserve memory
-            memmove(newPtr, ptr, originalSize - TAGS_SIZE);
-            mm_free(ptr);
-            // set surrounding block size
-            block_set_size(block_prev(newMallocBlock),
-                           block_prev_size(newMallocBlock));
-            block_set_size_and_allocated(newMallocBlock,
-                                         block_size(newMallocBlock), 1);
-            block_set_size(block_next(newMallocBlock),
-                           block_next_size(newMallocBlock));
-            return &newMallocBlock->payload[0];
-        }
-    }
-    // if equal
-    else {
-        block_set_size_and_allocated(myBlock, requestedSize, 1);
+    }
+#endif
+    return NULL;
+#endif
+}
+
+/*
+ * allocates a block whose payload address is offset bytes past a multiple
+ * of alignment; the slack in front of it is split off as a free block
+ * rather than wasted
+ * arguments: size: the desired payload size
+ *            alignment: a power of two, at least ALIGNMENT
+ *            offset: a multiple of ALIGNMENT below alignment
+ * returns: a pointer to the aligned payload, or NULL if the heap cannot grow
+ */
+static void *block_malloc_aligned(size_t size, size_t alignment,
+                                  size_t offset) {
+    size_t newBlockSize = block_size_for(size);
+    char *ptr, *aligned;
+#ifdef MM_FASTBINS
+    // the last block of this size freed was likely aligned the same way
+    if (newBlockSize <= FASTBIN_MAX &&
+        fastbins[newBlockSize / ALIGNMENT] != NULL) {
+        block_t *fastBlock = fastbins[newBlockSize / ALIGNMENT];
+        ptr = (char *)&fastBlock->payload[0];
+        if (aligned_payload(ptr, alignment, offset) == ptr) {
+            fastbins[newBlockSize / ALIGNMENT] = fastbin_next(fastBlock);
+            stats.fastbin_hits++;
+            return ptr;
+        }
+    }
+#endif
+    block_t *myBlock = find_aligned_block(newBlockSize, alignment, offset);
+#ifdef MM_FASTBINS
+    if (myBlock == NULL && fastbins_nonempty) {
+        fastbins_consolidate();
+        myBlock = find_aligned_block(newBlockSize, alignment, offset);
+    }
+#endif
+    if (myBlock != NULL) {
+        pull_free_block(myBlock);
+        block_set_allocated(myBlock, 1);
+        ptr = (char *)&myBlock->payload[0];
+    } else {
+        // grow the heap just far enough to fit the aligned block after the
+        // last block, reusing a free last block if there is one, so that
+        // back-to-back aligned blocks do not leave gaps between them
+        myBlock = epilogue;
+        size_t lastSize = 0;
+        if (block_prev_allocated(epilogue) == 0) {
+            myBlock = block_prev(epilogue);
+            lastSize = block_size(myBlock);
+        }
+        ptr = (char *)&myBlock->payload[0];
+        aligned = aligned_payload(ptr, alignment, offset);
+        size_t totalSize = (size_t)(aligned - ptr) + newBlockSize;
+        // the tree is only probed at two sizes, so a free last block can
+        // still turn out to be big enough; then it is used as it is
+        if (totalSize < lastSize) {
+            totalSize = lastSize;
+        }
+        if (totalSize > lastSize &&
+            heap_extend(totalSize - lastSize) == (void *)-1) {
+            fprintf(stderr, "mem_sbrk");
+            return NULL;
+        }
+        if (lastSize != 0) {
+            pull_free_block(myBlock);
+        }
+        // move epilogue foward (before myBlock is written, since myBlock may
+        // be the old epilogue)
+        epilogue = (block_t *)((char *)myBlock + totalSize);
+        block_set_size_and_allocated(myBlock, totalSize, 1);
         block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
-        return &myBlock->payload[0];
     }
+    aligned = aligned_payload(ptr, alignment, offset);
+    if (aligned != ptr) {
+        // split off the leading slack as a free block
+        block_t *alignedBlock = payload_to_block(aligned);
+        size_t leadSize = (size_t)(aligned - ptr);
+        size_t totalSize = block_size(myBlock);
+        stats.splits++;
+        block_set_size_and_allocated(myBlock, leadSize, 0);
+        block_set_size_and_allocated(alignedBlock, totalSize - leadSize, 1);
+        insert_free_block(myBlock);
+        coalesce(myBlock);
+        myBlock = alignedBlock;
+    }
+    // give back whatever is left over at the end
+    size_t leftOverSize = block_size(myBlock) - newBlockSize;
+    if (leftOverSize >= MINBLOCKSIZE) {
+        stats.splits++;
+        block_set_size(myBlock, newBlockSize);
+        block_t *splitBlock = block_next(myBlock);
+        block_set_size_and_allocated(splitBlock, leftOverSize, 0);
+        insert_free_block(splitBlock);
+        coalesce(splitBlock);
+    }
+    return aligned;
+}
+
+/*
+ * finds the run a pointer lies in; safe to call without heap_lock
+ * arguments: ptr: a payload pointer returned by mm_malloc
+ * returns: the run ptr is a slot of, or NULL if ptr is a block's payload
+ */
+static inline run_t *slot_run(void *ptr) {
+    size_t page = ((uintptr_t)ptr >> RUN_SHIFT) - run_map_base;
+    // the page count is read first: a map at least that big is published
+    // before it
+    if (page >= __atomic_load_n(&run_map_pages, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    unsigned char *map = __atomic_load_n(&run_map, __ATOMIC_RELAXED);
+    if ((__atomic_load_n(&map[page / 8], __ATOMIC_RELAXED) >> (page % 8)) & 1) {
+        // the run's block starts on the boundary; run_t is its payload
+        return (run_t *)(((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1)) +
+                         WORD_SIZE);
+    }
+    return NULL;
+}
+
+/*
+ * sets or clears the run_map bit for the page a run starts at, growing the
+ * map (a heap block of its own) when the run lies past its end. Called with
+ * heap_lock held.
+ * arguments: run: the run
+ *            isRun: 1 to mark the page as a run, 0 to unmark it
+ * returns: 0 if successful, -1 if the map could not grow
+ */
+static int run_map_set(run_t *run, int isRun) {
+    size_t page = ((uintptr_t)run >> RUN_SHIFT) - run_map_base;
+    if (page >= run_map_pages) {
+        if (!isRun) {
+            return 0;
+        }
+        // double the map, so growing it costs O(1) per run
+        size_t newPages = run_map_pages * 2;
+        if (newPages <= page) {
+            newPages = (page + 1 + 63) & ~(size_t)63;
+        }
+        unsigned char *newMap = block_malloc(newPages / 8);
+        if (newMap == NULL) {
+            return -1;
+        }
+        memset(newMap, 0, newPages / 8);
+        if (run_map != NULL) {
+            // the old map is left allocated: slot_run may still be reading
+            // it without the lock. Maps double, so the old ones together
+            // never take more room than the current one.
+            memcpy(newMap, run_map, run_map_pages / 8);
+        }
+        __atomic_store_n(&run_map, newMap, __ATOMIC_RELAXED);
+        __atomic_store_n(&run_map_pages, newPages, __ATOMIC_RELEASE);
+    }
+    unsigned char bits = run_map[page / 8];
+    if (isRun) {
+        bits |= (unsigned char)(1 << (page % 8));
+    } else {
+        bits &= (unsigned char)~(1 << (page % 8));
+    }
+    __atomic_store_n(&run_map[page / 8], bits, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// takes a run off its class's list of runs with free slots
+static inline void run_unlink(run_t *run, int class) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        avail_runs[class] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+// puts a run at the front of its class's list of runs with free slots
+static inline void run_push(run_t *run, int class) {
+    run->prev = NULL;
+    run->next = avail_runs[class];
+    if (run->next != NULL) {
+        run->next->prev = run;
+    }
+    avail_runs[class] = run;
+}
+
+/*
+ * allocates a slot from a run of the right size class, carving a new run
+ * out of the heap if every run of that class is full
+ * arguments: size: the desired payload size, at most SLAB_MAX
+ * returns: a pointer to the slot, or NULL if the heap cannot grow
+ */
+static void *slab_malloc(size_t size) {
+    int class = (int)((size - 1) / ALIGNMENT);
+    run_t *run = avail_runs[class];
+    if (run == NULL) {
+        run = block_malloc_aligned(RUN_SIZE - WORD_SIZE, RUN_SIZE, WORD_SIZE);
+        if (run == NULL) {
+            return NULL;
+        }
+        if (run_map_set(run, 1) < 0) {
+            block_free(run);
+            return NULL;
+        }
+        run->free_slots = NULL;
+        run->bump = RUN_HEADER_SIZE;
+        run->slot_size = (uint16_t)((class + 1) * ALIGNMENT);
+        run->nfree = (uint16_t)RUN_SLOTS(run->slot_size);
+        run_push(run, class);
+    }
+    char *slot = run->free_slots;
+    if (slot != NULL) {
+        run->free_slots = *(char **)slot;
+    } else {
+        slot = (char *)run + run->bump;
+        run->bump += run->slot_size;
+    }
+    if (--run->nfree == 0) {
+        run_unlink(run, class);
+    }
+    return slot;
+}
+
+/*
+ * returns a slot to its run; a run that becomes empty goes back to the heap
+ * as a block, unless it is the only run its class has left
+ * arguments: run: the run the slot belongs to
+ *            ptr: the slot
+ * returns: nothing
+ */
+static void slab_free(run_t *run, void *ptr) {
+    int class = run->slot_size / ALIGNMENT - 1;
+    *(char **)ptr = run->free_slots;
+    run->free_slots = ptr;
+    if (run->nfree++ == 0) {
+        run_push(run, class);
+    }
+    // keep one empty run per class so a class that empties and refills does
+    // not carve and release a run every time
+    if (run->nfree == RUN_SLOTS(run->slot_size) &&
+        (avail_runs[class] != run || run->next != NULL)) {
+        run_unlink(run, class);
+        run_map_set(run, 0);
+        block_free(run);
+    }
+}
+
+/*
+ * frees a slot, a mapped block or a heap block; called with heap_lock held
+ * arguments: run: the run ptr is a slot of, or NULL if it is not a slot
+ *            ptr: the payload
+ * returns: nothing
+ */
+static void heap_free(run_t *run, void *ptr) {
+    block_t *myBlock = payload_to_block(ptr);
+    if (run != NULL) {
+        slab_free(run, ptr);
+    } else if (block_mapped(myBlock)) {
+        char *base = mapped_base(myBlock);
+        mem_unmap(base, (size_t)((char *)myBlock - base) + block_size(myBlock));
+    } else {
+        purge_pending += block_size(myBlock);
+        // a large free neighbour keeps aging once the block has merged into
+        // it; the block's own pages are then purged along with it
+        int seen = (block_prev_allocated(myBlock) == 0 &&
+                    block_purge_seen(block_prev(myBlock))) ||
+                   (block_next_allocated(myBlock) == 0 &&
+                    block_purge_seen(block_next(myBlock)));
+        block_t *freeBlock = block_free(ptr);
+        if (seen && freeBlock != NULL) {
+            block_set_purge_seen(freeBlock);
+        }
+    }
+    // not done in block_free, so a block that mm_realloc just moved to the
+    // end of the heap does not give back the space it is about to grow into
+    heap_trim();
+    if (purge_pending >= PURGE_BATCH) {
+        heap_purge();
+    }
+}
+
+/*
+ * frees everything on the remote free queue, coalescing blocks as usual.
+ * Called with heap_lock held.
+ * arguments: none
+ * returns: nothing
+ */
+static void remote_drain(void) {
+    // taking the whole list at once means no other consumer can see a node
+    // between being read and being unlinked, so there is no ABA problem
+    void *ptr = __atomic_exchange_n(&remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void *next = *(void **)ptr;
+        heap_free(slot_run(ptr), ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * pushes a freed slot or block onto the remote free queue; lock-free
+ * arguments: ptr: the slot or block payload
+ * returns: nothing
+ */
+static void remote_push(void *ptr) {
+    void *head = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&remote_frees, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// takes heap_lock and frees whatever other threads queued while it was held
+static inline void heap_lock_acquire(void) {
+    pthread_mutex_lock(&heap_lock);
+    if (__atomic_load_n(&remote_frees, __ATOMIC_RELAXED) != NULL) {
+        remote_drain();
+    }
+}
+
+#ifndef MM_NO_TCACHE
+/*
+ * gives the slots in a thread's cache back to their runs when the thread
+ * exits
+ * arguments: arg: the exiting thread's tcache
+ * returns: nothing
+ */
+static void tcache_destroy(void *arg) {
+    tcache_t *cache = arg;
+    heap_lock_acquire();
+    if (cache->generation == heap_generation) {
+        for (int class = 0; class < NUM_SLAB_CLASSES; class++) {
+            char *slot;
+            while ((slot = cache->slots[class]) != NULL) {
+                cache->slots[class] = *(char **)slot;
+                slab_free(slot_run(slot), slot);
+            }
+            cache->count[class] = 0;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * returns the calling thread's cache, emptied first if its slots came from
+ * an earlier heap, and registers it to be flushed when the thread exits
+ * arguments: none
+ * returns: the thread's tcache
+ */
+static inline tcache_t *tcache_get(void) {
+    tcache_t *cache = &tcache;
+    if (cache->generation != heap_generation) {
+        for (int class = 0; class < NUM_SLAB_CLASSES; class++) {
+            cache->slots[class] = NULL;
+            cache->count[class] = 0;
+        }
+        cache->generation = heap_generation;
+    }
+    if (!cache->registered) {
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, cache);
+        cache->registered = 1;
+    }
+    return cache;
+}
+
+/*
+ * takes a slot from the thread's cache, refilling the cache with a batch of
+ * slots from the heap if it is empty
+ * arguments: size: the desired payload size, at most SLAB_MAX
+ * returns: a pointer to the slot, or NULL if the heap cannot grow
+ */
+static void *tcache_malloc(size_t size) {
+    int class = (int)((size - 1) / ALIGNMENT);
+    tcache_t *cache = tcache_get();
+    char *slot = cache->slots[class];
+    if (slot == NULL) {
+        heap_lock_acquire();
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            char *newSlot = slab_malloc(size);
+            if (newSlot == NULL) {
+                break;
+            }
+            *(char **)newSlot = slot;
+            slot = newSlot;
+            cache->count[class]++;
+        }
+        pthread_mutex_unlock(&heap_lock);
+        if (slot == NULL) {
+            return NULL;
+        }
+    }
+    cache->slots[class] = *(char **)slot;
+    cache->count[class]--;
+    return slot;
+}
+
+/*
+ * puts a freed slot in the thread's cache, first handing half the cache
+ * back to the heap if it is full
+ * arguments: class: the size class of the slot's run
+ *            ptr: the slot
+ * returns: nothing
+ */
+static void tcache_free(int class, void *ptr) {
+    tcache_t *cache = tcache_get();
+    if (cache->count[class] >= TCACHE_MAX) {
+        heap_lock_acquire();
+        for (int i = 0; i < TCACHE_MAX / 2; i++) {
+            char *slot = cache->slots[class];
+            cache->slots[class] = *(char **)slot;
+            slab_free(slot_run(slot), slot);
+        }
+        pthread_mutex_unlock(&heap_lock);
+        cache->count[class] -= TCACHE_MAX / 2;
+    }
+    *(char **)ptr = cache->slots[class];
+    cache->slots[class] = ptr;
+    cache->count[class]++;
+}
+#endif
+
+#ifdef MM_PERCPU
+// returns the calling thread's rseq area, which glibc registered with the
+// kernel when the thread started
+static inline struct rseq *rseq_area(void) {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// The assembly below follows the kernel's rseq ABI: a struct rseq_cs in the
+// __rseq_cs section gives the critical section's start (1), the length up
+// to just past its one committing store (2) and the abort handler (4), which
+// must be preceded by the RSEQ_SIG signature glibc registered. Storing the
+// descriptor's address in rseq_cs arms it; if the thread is preempted,
+// migrated or signalled between 1 and 2 the kernel resumes it at 4 instead.
+#define RSEQ_CS_BEGIN                           \
+    ".pushsection __rseq_cs, \"aw\"\n\t"        \
+    ".balign 32\n\t"                            \
+    "3:\n\t"                                    \
+    ".long 0, 0\n\t"                            \
+    ".quad 1f, 2f - 1f, 4f\n\t"                 \
+    ".popsection\n\t"                           \
+    "leaq 3b(%%rip), %%rax\n\t"                 \
+    "movq %%rax, %[rseq_cs]\n\t"                \
+    "1:\n\t"                                    \
+    "cmpl %[cpu], %[cpu_id]\n\t"                \
+    "jnz %l[abort]\n\t"
+#define RSEQ_CS_END                             \
+    "2:\n\t"                                    \
+    ".pushsection __rseq_failure, \"ax\"\n\t"   \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                \
+    ".long 0x53053053\n\t"                      \
+    "4:\n\t"                                    \
+    "jmp %l[abort]\n\t"                         \
+    ".popsection\n\t"
+
+/*
+ * pushes a slot onto the current CPU's cache for its class
+ * arguments: class: the slot's slab class
+ *            slot: the slot
+ * returns: 0 if it was cached, -1 if the cache is full or the CPU has none
+ */
+static inline int pcpu_push(int class, char *slot) {
+    struct rseq *rs = rseq_area();
+    for (;;) {
+        int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu < 0 || cpu >= pcpu_count) {
+            return -1;
+        }
+        pcpu_cache_t *cache = &pcpu_caches[cpu];
+        // the slot is written above the top of the stack first; only the
+        // store of the new count publishes it
+        __asm__ __volatile__ goto(
+            RSEQ_CS_BEGIN
+            "movq %[count], %%rax\n\t"
+            "cmpq %[max], %%rax\n\t"
+            "jae %l[full]\n\t"
+            "movq %[slot], (%[slots], %%rax, 8)\n\t"
+            "incq %%rax\n\t"
+            "movq %%rax, %[count]\n\t"
+            RSEQ_CS_END
+            :
+            : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+              [cpu] "r"(cpu), [count] "m"(cache->count[class]),
+              [slots] "r"(cache->slots[class]), [slot] "r"(slot),
+              [max] "i"(PCPU_MAX)
+            : "memory", "cc", "rax"
+            : abort, full);
+        return 0;
+    abort:
+        continue;
+    full:
+        return -1;
+    }
+}
+
+/*
+ * pops a slot off the current CPU's cache for a class
+ * arguments: class: the slab class
+ *            slot: set to the slot on success
+ * returns: 0 on success, -1 if the cache is empty or the CPU has none
+ */
+static inline int pcpu_pop(int class, char **slot) {
+    struct rseq *rs = rseq_area();
+    for (;;) {
+        int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+        if (cpu < 0 || cpu >= pcpu_count) {
+            return -1;
+        }
+        pcpu_cache_t *cache = &pcpu_caches[cpu];
+        __asm__ __volatile__ goto(
+            RSEQ_CS_BEGIN
+            "movq %[count], %%rax\n\t"
+            "testq %%rax, %%rax\n\t"
+            "jz %l[empty]\n\t"
+            "decq %%rax\n\t"
+            "movq (%[slots], %%rax, 8), %%rdx\n\t"
+            "movq %%rdx, (%[result])\n\t"
+            "movq %%rax, %[count]\n\t"
+            RSEQ_CS_END
+            :
+            : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+              [cpu] "r"(cpu), [count] "m"(cache->count[class]),
+              [slots] "r"(cache->slots[class]), [result] "r"(slot)
+            : "memory", "cc", "rax", "rdx"
+            : abort, empty);
+        return 0;
+    abort:
+        continue;
+    empty:
+        return -1;
+    }
+}
+
+/*
+ * takes a slot from the current CPU's cache, refilling it with a batch of
+ * slots from the heap if it is empty
+ * arguments: size: the desired payload size, at most SLAB_MAX
+ * returns: a pointer to the slot, or NULL if the heap cannot grow
+ */
+static void *pcpu_malloc(size_t size) {
+    int class = (int)((size - 1) / ALIGNMENT);
+    char *batch[PCPU_BATCH];
+    if (pcpu_pop(class, &batch[0]) == 0) {
+        return batch[0];
+    }
+    int n = 0;
+    heap_lock_acquire();
+    while (n < PCPU_BATCH && (batch[n] = slab_malloc(size)) != NULL) {
+        n++;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (n == 0) {
+        return NULL;
+    }
+    // keep the first and cache the rest on whichever CPU the thread is on
+    // now; any that do not fit go straight back
+    int i = 1;
+    while (i < n && pcpu_push(class, batch[i]) == 0) {
+        i++;
+    }
+    if (i < n) {
+        heap_lock_acquire();
+        for (; i < n; i++) {
+            slab_free(slot_run(batch[i]), batch[i]);
+        }
+        pthread_mutex_unlock(&heap_lock);
+    }
+    return batch[0];
+}
+
+/*
+ * puts a freed slot in the current CPU's cache, first handing half of the
+ * cache back to the heap if it is full
+ * arguments: run: the run the slot belongs to
+ *            ptr: the slot
+ * returns: nothing
+ */
+static void pcpu_free(run_t *run, void *ptr) {
+    int class = run->slot_size / ALIGNMENT - 1;
+    while (pcpu_push(class, ptr) < 0) {
+        char *batch[PCPU_MAX / 2];
+        int n = 0;
+        while (n < PCPU_MAX / 2 && pcpu_pop(class, &batch[n]) == 0) {
+            n++;
+        }
+        heap_lock_acquire();
+        for (int i = 0; i < n; i++) {
+            slab_free(slot_run(batch[i]), batch[i]);
+        }
+        if (n == 0) {
+            // the CPU has no cache (or keeps losing it): free directly
+            slab_free(run, ptr);
+        }
+        pthread_mutex_unlock(&heap_lock);
+        if (n == 0) {
+            return;
+        }
+    }
+}
+#endif
+
+/*
+ * returns which cache small requests go through (see mm.h)
+ * arguments: none
+ * returns: MM_CACHE_CPU, MM_CACHE_THREAD or MM_CACHE_NONE
+ */
+int mm_cache_mode(void) { return cache_mode; }
+
+/*
+ * copies out the allocator's counters for the current heap
+ * arguments: out: where to copy them
+ * returns: nothing
+ */
+void mm_get_stats(mm_stats_t *out) {
+    pthread_mutex_lock(&heap_lock);
+    *out = stats;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*     _ __ ___  _ __ ___      _ __ ___   __ _| | | ___   ___
+ *    | '_ ` _ \| '_ ` _ \    | '_ ` _ \ / _` | | |/ _ \ / __|
+ *    | | | | | | | | | | |   | | | | | | (_| | | | (_) | (__
+ *    |_| |_| |_|_| |_| |_|___|_| |_| |_|\__,_|_|_|\___/ \___|
+ *                       |_____|
+ *
+ * allocates a block of memory and returns a pointer to that block's payload
+ * arguments: size: the desired payload size for the block
+ * returns: a pointer to the newly-allocated block's payload (whose size
+ *          is a multiple of ALIGNMENT), or NULL if an error occurred
+ */
+void *mm_malloc(size_t size) {
+    if (size <= 0) {
+        fprintf(stderr, "size is 0 or below");
+        return NULL;
+    }
+    void *ptr;
+#ifdef MM_PERCPU
+    if (size <= SLAB_MAX && cache_mode == MM_CACHE_CPU) {
+        return pcpu_malloc(size);
+    }
+#endif
+#ifndef MM_NO_TCACHE
+    if (size <= SLAB_MAX) {
+        return tcache_malloc(size);
+    }
+#endif
+    heap_lock_acquire();
+    if (size <= SLAB_MAX) {
+        ptr = slab_malloc(size);
+    } else if (size >= MMAP_THRESHOLD) {
+        ptr = mapped_malloc(size, ALIGNMENT);
+    } else {
+        ptr = block_malloc(size);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+/*                              __
+ *     _ __ ___  _ __ ___      / _|_ __ ___  ___
+ *    | '_ ` _ \| '_ ` _ \    | |_| '__/ _ \/ _ \
+ *    | | | | | | | | | | |   |  _| | |  __/  __/
+ *    |_| |_| |_|_| |_| |_|___|_| |_|  \___|\___|
+ *                       |_____|
+ *
+ * frees a block of memory, enabling it to be reused later
+ * arguments: ptr: pointer to the block's payload
+ * returns: nothing
+ */
+void mm_free(void *ptr) {
+    if (ptr != NULL) {
+        run_t *run = slot_run(ptr);
+#ifdef MM_PERCPU
+        if (run != NULL && cache_mode == MM_CACHE_CPU) {
+            pcpu_free(run, ptr);
+            return;
+        }
+#endif
+#ifndef MM_NO_TCACHE
+        if (run != NULL) {
+            tcache_free(run->slot_size / ALIGNMENT - 1, ptr);
+            return;
+        }
+#endif
+        // if another thread holds the lock, leave the block for it (or the
+        // next thread to take the lock) to free rather than waiting
+        if (pthread_mutex_trylock(&heap_lock) != 0) {
+            remote_push(ptr);
+            return;
+        }
+        if (__atomic_load_n(&remote_frees, __ATOMIC_RELAXED) != NULL) {
+            remote_drain();
+        }
+        heap_free(run, ptr);
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+/*
+ * grows an allocated heap block without moving it, either into the free
+ * block after it or, if it is the last block, by growing the heap
+ * arguments: myBlock: the block
+ *            size: the block size it needs
+ * returns: the block's size afterwards, which is its old size if it could
+ *          not grow that far or was that big already
+ */
+static size_t block_grow_in_place(block_t *myBlock, size_t size) {
+    size_t originalSize = block_size(myBlock);
+    if (originalSize >= size) {
+        return originalSize;
+    }
+    block_t *nextBlock = block_next(myBlock);
+    size_t nextSize = block_allocated(nextBlock) ? 0 : block_size(nextBlock);
+    if (nextSize != 0 && originalSize + nextSize >= size) {
+        // the next block is free and the two together are big enough:
+        // grow into it in place
+        pull_free_block(nextBlock);
+        originalSize += nextSize;
+        block_set_size(myBlock, originalSize);
+    } else if ((char *)myBlock + originalSize + nextSize == (char *)epilogue) {
+        // the block is the last one, or only a free block follows it:
+        // grow the heap by the shortfall and keep the data where it is
+        size_t growSize = heap_grow_size(size - originalSize - nextSize);
+        if (heap_extend(growSize) == (void *)-1) {
+            fprintf(stderr, "mem_sbrk");
+            return originalSize;
+        }
+        if (nextSize != 0) {
+            pull_free_block(nextBlock);
+        }
+        originalSize += nextSize + growSize;
+        // move epilogue foward (before myBlock is resized, since its new
+        // end is the new epilogue)
+        epilogue = (block_t *)((char *)myBlock + originalSize);
+        block_set_size(myBlock, originalSize);
+        block_set_size_and_allocated(epilogue, TAGS_SIZE, 1);
+    }
+    return originalSize;
+}
+
+/*
+ * resizes a block (never a slot), in place if it can
+ * arguments: ptr: a pointer to the block's payload
+ *            size: the desired new payload size
+ * returns: a pointer to the new block's payload, or NULL if the heap cannot
+ *          grow
+ */
+static void *block_realloc(void *ptr, size_t size) {
+    // keeping tracks of sizes
+    size_t requestedSize = block_size_for(size);
+    block_t *myBlock = payload_to_block(ptr);
+    size_t originalSize = block_size(myBlock);
+    grower_t *grower = grower_find(myBlock);
+    int grows = requestedSize > originalSize;
+
+    if (grows) {
+        originalSize = block_grow_in_place(myBlock, requestedSize);
+    }
+    // failing that, slide it down into a free block in front of it
+    if (grows && originalSize < requestedSize) {
+        block_t *nextBlock = block_next(myBlock);
+        size_t nextSize =
+            block_allocated(nextBlock) ? 0 : block_size(nextBlock);
+        size_t prevSize =
+            block_prev_allocated(myBlock) ? 0 : block_prev_size(myBlock);
+        if (prevSize + originalSize + nextSize >= requestedSize) {
+            // the free blocks on either side are big enough together: take
+            // them and slide the data down into the previous one
+            block_t *prevBlock = block_prev(myBlock);
+            pull_free_block(prevBlock);
+            if (nextSize != 0) {
+                pull_free_block(nextBlock);
+            }
+            memmove(&prevBlock->payload[0], ptr, originalSize - WORD_SIZE);
+            count_copied(originalSize - WORD_SIZE);
+            originalSize += prevSize + nextSize;
+            block_set_size_and_allocated(prevBlock, originalSize, 1);
+            myBlock = prevBlock;
+            if (grower != NULL) {
+                grower->block = myBlock;
+            }
+        }
+    }
+
+    // if the block is (now) big enough, keep it and hand back the tail as a
+    // free block when it is at least the minimum size. A block that keeps
+    // growing holds on to some slack; one that shrinks has stopped growing.
+    if (requestedSize <= originalSize) {
+        size_t keepSize = requestedSize;
+        if (grower != NULL && requestedSize >= grower->need) {
+            grower->need = requestedSize;
+            keepSize += slack_for(requestedSize);
+        } else if (grower != NULL) {
+            grower->block = NULL;
+        } else if (grows) {
+            grower_add(myBlock, requestedSize);
+        }
+        if (originalSize >= keepSize &&
+            originalSize - keepSize >= MINBLOCKSIZE) {
+            stats.splits++;
+            block_set_size(myBlock, keepSize);
+            block_t *splitBlock = block_next(myBlock);
+            block_set_size_and_allocated(splitBlock, originalSize - keepSize,
+                                         0);
+            insert_free_block(splitBlock);
+            coalesce(splitBlock);
+        }
+        return &myBlock->payload[0];
+    }
+
+    // otherwise move, with slack if the block has grown before (or map the
+    // block if it has grown past MMAP_THRESHOLD). It is forgotten first, so
+    // block_malloc does not cut it down while it is being copied.
+    size_t newSize = size;
+    if (grower != NULL) {
+        grower->block = NULL;
+        newSize += slack_for(requestedSize);
+    }
+    void *newPtr =
+        size >= MMAP_THRESHOLD ? mapped_malloc(size, ALIGNMENT)
+                               : block_malloc(newSize);
+    if (newPtr == NULL) {
+        return NULL;
+    }
+    // preserve memory
+    copy_payload(newPtr, ptr, originalSize - WORD_SIZE);
+    block_free(ptr);
+    if (size < MMAP_THRESHOLD) {
+        grower_add(payload_to_block(newPtr), requestedSize);
+    }
+    return newPtr;
+}
+
+/*
+ *                                            _ _
+ *     _ __ ___  _ __ ___      _ __ ___  __ _| | | ___   ___
+ *    | '_ ` _ \| '_ ` _ \    | '__/ _ \/ _` | | |/ _ \ / __|
+ *    | | | | | | | | | | |   | | |  __/ (_| | | | (_) | (__
+ *    |_| |_| |_|_| |_| |_|___|_|  \___|\__,_|_|_|\___/ \___|
+ *                       |_____|
+ *
+ * reallocates a memory block to update it with a new given size
+ * arguments: ptr: a pointer to the memory block's payload
+ *            size: the desired new payload size
+ * returns: a pointer to the new memory block's payload
+ */
+void *mm_realloc(void *ptr, size_t size) {
+    // TODO
+    // edge cases
+    if (ptr == NULL) {
+        return mm_malloc(size);
+    }
+
+    if (size == 0) {
+        return NULL;
+    }
+    // a slot can change size within its class; past that it moves, so the
+    // size a slot was last asked for always gives its class (which
+    // mm_free_sized relies on)
+    run_t *run = slot_run(ptr);
+    if (run != NULL) {
+        if (size <= run->slot_size && size + ALIGNMENT > run->slot_size) {
+            return ptr;
+        }
+        void *newPtr = mm_malloc(size);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        copy_payload(newPtr, ptr, size < run->slot_size ? size : run->slot_size);
+        mm_free(ptr);
+        return newPtr;
+    }
+    // a mapped block that is still big enough to be mapped is resized with
+    // mem_remap, which never copies; otherwise it moves into the heap
+    block_t *myBlock = payload_to_block(ptr);
+    if (block_mapped(myBlock)) {
+        size_t payloadSize = block_size(myBlock) - WORD_SIZE;
+        if (size >= MMAP_THRESHOLD) {
+            // the block keeps its place in its first page, and so its
+            // alignment
+            size_t pageSize = mem_pagesize();
+            char *base = mapped_base(myBlock);
+            size_t offset = (size_t)((char *)myBlock - base);
+            size_t mapSize =
+                (offset + size + WORD_SIZE + pageSize - 1) & ~(pageSize - 1);
+            if (mapSize < size) {
+                return NULL;
+            }
+            if (mapSize == offset + block_size(myBlock)) {
+                return ptr;
+            }
+            // memlib's list of mappings is shared with mapped_malloc and
+            // heap_free in other threads, which use it under heap_lock
+            heap_lock_acquire();
+            char *newBase =
+                mem_remap(base, offset + block_size(myBlock), mapSize);
+            if (newBase == (void *)-1) {
+                pthread_mutex_unlock(&heap_lock);
+                return NULL;
+            }
+            block_t *newBlock = (block_t *)(newBase + offset);
+            newBlock->size = (mapSize - offset) | (newBlock->size & BLOCK_FLAGS);
+            pthread_mutex_unlock(&heap_lock);
+            return &newBlock->payload[0];
+        }
+        void *newPtr = mm_malloc(size);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        copy_payload(newPtr, ptr, size < payloadSize ? size : payloadSize);
+        mm_free(ptr);
+        return newPtr;
+    }
+    // a heap block shrinking to slot size moves into a slot, so that every
+    // block last asked for with a slot size is one
+    if (size <= SLAB_MAX) {
+        size_t payloadSize = block_size(myBlock) - WORD_SIZE;
+        void *newPtr = mm_malloc(size);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        copy_payload(newPtr, ptr, size < payloadSize ? size : payloadSize);
+        mm_free(ptr);
+        return newPtr;
+    }
+    heap_lock_acquire();
+    void *newPtr = block_realloc(ptr, size);
+    pthread_mutex_unlock(&heap_lock);
+    return newPtr;
+}
+
+/*
+ * allocates an array of nmemb elements of size bytes each, cleared to zero.
+ * Only the part of the payload not known to read as zero already (pages
+ * fresh from mem_sbrk or mem_map, or purged) is cleared
+ * arguments: nmemb: the number of elements
+ *            size: the size of each element
+ * returns: a pointer to the zeroed payload, or NULL if nmemb * size is 0,
+ *          overflows or cannot be allocated
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total) || total == 0) {
+        return NULL;
+    }
+    if (total <= SLAB_MAX) {
+        void *slot = mm_malloc(total);
+        if (slot != NULL) {
+            memset(slot, 0, total);
+        }
+        return slot;
+    }
+    heap_lock_acquire();
+    if (total >= MMAP_THRESHOLD) {
+        // a new mapping reads as zero
+        void *mapped = mapped_malloc(total, ALIGNMENT);
+        if (mapped != NULL) {
+            stats.calloc_skipped += total;
+        }
+        pthread_mutex_unlock(&heap_lock);
+        return mapped;
+    }
+    char *ptr = block_malloc(total);
+    if (ptr == NULL) {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+    // clear what lies outside [zeroLo, zeroHi)
+    char *end = ptr + total;
+    char *zeroLo = zero_lo > ptr ? zero_lo : ptr;
+    char *zeroHi = zero_hi < end ? zero_hi : end;
+    if (zeroLo >= zeroHi) {
+        zeroLo = zeroHi = end;
+    }
+    stats.calloc_skipped += (unsigned long)(zeroHi - zeroLo);
+    pthread_mutex_unlock(&heap_lock);
+    memset(ptr, 0, (size_t)(zeroLo - ptr));
+    memset(zeroHi, 0, (size_t)(end - zeroHi));
+    return ptr;
+}
+
+/*
+ * allocates a block whose payload is aligned to alignment bytes. The slack
+ * in front of an aligned heap block goes back to the free lists as a block
+ * of its own, where it merges with its neighbours like any other
+ * arguments: alignment: a power of two no bigger than the page size
+ *            size: the desired payload size
+ * returns: a pointer to the aligned payload, or NULL if alignment is not
+ *          supported, size is 0 or an error occurred
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+        alignment > mem_pagesize()) {
+        fprintf(stderr, "alignment is not a power of two up to a page");
+        return NULL;
+    }
+    // every payload is aligned that much anyway
+    if (alignment <= ALIGNMENT) {
+        return mm_malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+    void *ptr;
+    heap_lock_acquire();
+    if (size >= MMAP_THRESHOLD) {
+        ptr = mapped_malloc(size, alignment);
+    } else {
+        ptr = block_malloc_aligned(size, alignment, 0);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return ptr;
+}
+
+/*
+ * the C11 name for mm_memalign; size need not be a multiple of alignment
+ * arguments: alignment: a power of two no bigger than the page size
+ *            size: the desired payload size
+ * returns: a pointer to the aligned payload, or NULL on error
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * allocates n blocks with the same payload size at once. Slots are taken
+ * under a single lock. Heap blocks are cut out of as few blocks as
+ * block_malloc can find: each free block is filled with as many as fit, and
+ * when none is left the heap grows once for all the rest
+ * arguments: size: the desired payload size of each block
+ *            n: how many blocks to allocate
+ *            out: where to store the n payload pointers
+ * returns: how many blocks were allocated, which is less than n only if
+ *          memory ran out (out then holds those that were)
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    size_t done = 0;
+    if (size == 0 || n == 0) {
+        return 0;
+    }
+    heap_lock_acquire();
+    if (size <= SLAB_MAX) {
+        for (; done < n && (out[done] = slab_malloc(size)) != NULL; done++) {
+        }
+    } else if (size >= MMAP_THRESHOLD) {
+        for (; done < n && (out[done] = mapped_malloc(size, ALIGNMENT)) != NULL;
+             done++) {
+        }
+    } else {
+        size_t blockSize = block_size_for(size);
+        size_t total;
+        if (__builtin_mul_overflow(blockSize, n, &total)) {
+            n = 0;
+        }
+        while (done < n) {
+            size_t count = n - done;
+            block_t *freeBlock = find_free_block(blockSize);
+            if (freeBlock != NULL && block_size(freeBlock) / blockSize < count) {
+                count = block_size(freeBlock) / blockSize;
+            }
+            char *first = block_malloc(count * blockSize - WORD_SIZE);
+            if (first == NULL) {
+                break;
+            }
+            // cut the block into count, the last one keeping any extra bytes
+            block_t *myBlock = payload_to_block(first);
+            size_t rest = block_size(myBlock);
+            out[done++] = first;
+            for (; --count > 0; done++) {
+                block_set_size(myBlock, blockSize);
+                rest -= blockSize;
+                myBlock = block_next(myBlock);
+                block_set_size_and_allocated(myBlock, rest, 1);
+                out[done] = &myBlock->payload[0];
+            }
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return done;
+}
+
+// orders payload pointers by address, for qsort
+static int ptr_compare(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) * (void *const *)a;
+    uintptr_t y = (uintptr_t) * (void *const *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * frees n blocks at once, under a single lock. The pointers are sorted by
+ * address first, so a run of heap blocks that lie next to each other is
+ * merged into one block and freed, and coalesced, in one step
+ * arguments: ptrs: the payloads to free, which may include NULLs; the array
+ *                  is left sorted
+ *            n: how many pointers ptrs holds
+ * returns: nothing
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    qsort(ptrs, n, sizeof(*ptrs), ptr_compare);
+    heap_lock_acquire();
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+        run_t *run = slot_run(ptr);
+        block_t *myBlock = payload_to_block(ptr);
+        if (run == NULL && !block_mapped(myBlock)) {
+            // take in the blocks freed right after this one
+            size_t size = block_size(myBlock);
+            block_t *nextBlock = block_next(myBlock);
+            while (i + 1 < n && ptrs[i + 1] == &nextBlock->payload[0]) {
+                grower_t *grower = grower_find(nextBlock);
+                if (grower != NULL) {
+                    grower->block = NULL;
+                }
+                stats.coalesces++;
+                size += block_size(nextBlock);
+                nextBlock = block_next(nextBlock);
+                i++;
+            }
+            block_set_size(myBlock, size);
+        }
+        heap_free(run, ptr);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * frees a block whose size the caller knows: the size it was last
+ * allocated or reallocated with. Every slot was last asked for with a size
+ * in its own class, so for a slot the size alone gives the thread cache
+ * bin, and the run's header is never read. Blocks of at most SLAB_MAX bytes
+ * can still be heap blocks (mm_memalign's, aligned past ALIGNMENT), so the
+ * pointer's run_map bit is checked first and anything else goes to mm_free.
+ * The size is trusted otherwise: a wrong one for a slot corrupts the heap.
+ * arguments: ptr: pointer to the block's payload
+ *            size: the payload size last asked for
+ * returns: nothing
+ */
+void mm_free_sized(void *ptr, size_t size) {
+#ifndef MM_NO_TCACHE
+    if (ptr != NULL && size - 1 < SLAB_MAX && cache_mode == MM_CACHE_THREAD &&
+        slot_run(ptr) != NULL) {
+        tcache_free((int)((size - 1) / ALIGNMENT), ptr);
+        return;
+    }
+#endif
+    (void)size;
+    mm_free(ptr);
+}
+
+/*
+ * returns how many bytes the block at ptr can hold, which may be more than
+ * was asked for: slots hold their whole class, and heap blocks have the
+ * payload rounded up and keep remainders too small to split off. The slack
+ * mm_realloc gives a growing block is not counted, since it may be taken
+ * back
+ * arguments: ptr: pointer to the block's payload, or NULL
+ * returns: the usable payload size, or 0 for NULL
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    run_t *run = slot_run(ptr);
+    if (run != NULL) {
+        return run->slot_size;
+    }
+    block_t *myBlock = payload_to_block(ptr);
+    if (block_mapped(myBlock)) {
+        return block_size(myBlock) - WORD_SIZE;
+    }
+    heap_lock_acquire();
+    grower_t *grower = grower_find(myBlock);
+    size_t size = grower != NULL ? grower->need : block_size(myBlock);
+    pthread_mutex_unlock(&heap_lock);
+    return size - WORD_SIZE;
+}
+
+/*
+ * grows the block at ptr without moving it, to hold at least min bytes and
+ * as many as max. It takes in the free block after it, or grows the heap if
+ * it is the last block (see block_grow_in_place); slots and mapped blocks
+ * only have the room mm_usable_size reports. A block that already holds
+ * more than max keeps it
+ * arguments: ptr: pointer to the block's payload, or NULL
+ *            min: the least payload size that will do
+ *            max: the payload size wanted
+ * returns: the new usable payload size, or 0 if ptr is NULL or the block
+ *          cannot hold min bytes in place (it is left as it was)
+ */
+size_t mm_expand(void *ptr, size_t min, size_t max) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (max < min) {
+        max = min;
+    }
+    block_t *myBlock = payload_to_block(ptr);
+    if (slot_run(ptr) != NULL || block_mapped(myBlock)) {
+        size_t usable = mm_usable_size(ptr);
+        return usable >= min ? usable : 0;
+    }
+    if (max >= MMAP_THRESHOLD) {
+        max = MMAP_THRESHOLD - 1;
+        if (max < min) {
+            return 0;
+        }
+    }
+    heap_lock_acquire();
+    size_t minSize = block_size_for(min);
+    size_t maxSize = block_size_for(max);
+    size_t originalSize = block_size(myBlock);
+    size_t blockSize = block_grow_in_place(myBlock, maxSize);
+    if (blockSize < minSize) {
+        blockSize = block_grow_in_place(myBlock, minSize);
+    }
+    if (blockSize < minSize) {
+        pthread_mutex_unlock(&heap_lock);
+        return 0;
+    }
+    // the caller may use all of it now, so it is no longer slack to take back
+    grower_t *grower = grower_find(myBlock);
+    if (grower != NULL) {
+        grower->block = NULL;
+    }
+    // hand back what was grown past max, but never what the block already
+    // held
+    size_t keepSize = maxSize > originalSize ? maxSize : originalSize;
+    if (blockSize > keepSize && blockSize - keepSize >= MINBLOCKSIZE) {
+        stats.splits++;
+        block_set_size(myBlock, keepSize);
+        block_t *splitBlock = block_next(myBlock);
+        block_set_size_and_allocated(splitBlock, blockSize - keepSize, 0);
+        insert_free_block(splitBlock);
+        coalesce(splitBlock);
+        blockSize = keepSize;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return blockSize - WORD_SIZE;
+}
+
+/*
+ * takes a chunk for an arena from the heap, or maps one if it is that big,
+ * and pushes it onto one of the arena's lists
+ * arguments: list: the list to push the chunk onto
+ *            size: the payload size the chunk needs
+ * returns: the chunk, or NULL if there is no memory left
+ */
+static arena_chunk_t *arena_chunk_new(arena_chunk_t **list, size_t size) {
+    heap_lock_acquire();
+    arena_chunk_t *chunk = size >= MMAP_THRESHOLD
+                               ? mapped_malloc(size, ALIGNMENT)
+                               : block_malloc(size);
+    pthread_mutex_unlock(&heap_lock);
+    if (chunk != NULL) {
+        chunk->next = *list;
+        *list = chunk;
+    }
+    return chunk;
+}
+
+// frees every chunk on a list. Called with heap_lock held.
+static void arena_chunks_free(arena_chunk_t *chunk) {
+    while (chunk != NULL) {
+        arena_chunk_t *next = chunk->next;
+        heap_free(NULL, chunk);
+        chunk = next;
+    }
+}
+
+/*
+ * creates an empty arena. An arena lives in the heap, so mm_init ends it
+ * along with everything else; it must not be used by two threads at once,
+ * though different arenas may be
+ * arguments: none
+ * returns: the arena, or NULL if there is no memory left
+ */
+mm_arena_t *mm_arena_create(void) {
+    mm_arena_t *arena = mm_malloc(sizeof(mm_arena_t));
+    if (arena != NULL) {
+        arena->chunks = NULL;
+        arena->big = NULL;
+        arena->bump = NULL;
+        arena->limit = NULL;
+    }
+    return arena;
+}
+
+/*
+ * allocates size bytes from an arena when they do not fit in its current
+ * chunk, by taking a new chunk from the heap
+ * arguments: arena: the arena
+ *            size: the payload size, already aligned
+ * returns: the payload, or NULL if there is no memory left
+ */
+static void *arena_alloc_chunk(mm_arena_t *arena, size_t size) {
+    arena_chunk_t *chunk;
+    if (size > ARENA_CHUNK_SIZE / 4) {
+        chunk = arena_chunk_new(&arena->big, sizeof(arena_chunk_t) + size);
+        return chunk != NULL ? chunk + 1 : NULL;
+    }
+    chunk = arena_chunk_new(&arena->chunks, ARENA_CHUNK_SIZE - WORD_SIZE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    block_t *chunkBlock = payload_to_block(chunk);
+    arena->limit = (char *)chunkBlock + block_size(chunkBlock);
+    arena->bump = (char *)(chunk + 1) + size;
+    return chunk + 1;
+}
+
+/*
+ * allocates size bytes from an arena. They stay allocated until the arena
+ * is reset or destroyed; there is no freeing them one at a time
+ * arguments: arena: the arena
+ *            size: the payload size
+ * returns: the payload, aligned to ALIGNMENT, or NULL if size is 0 or there
+ *          is no memory left
+ */
+void *mm_arena_alloc(mm_arena_t *arena, size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    size = align(size);
+    if (size <= (size_t)(arena->limit - arena->bump)) {
+        void *ptr = arena->bump;
+        arena->bump += size;
+        return ptr;
+    }
+    return arena_alloc_chunk(arena, size);
+}
+
+/*
+ * frees everything allocated from an arena at once. The chunk being bumped
+ * through is kept to bump through again, and every other chunk is freed
+ * whole
+ * arguments: arena: the arena
+ * returns: nothing
+ */
+void mm_arena_reset(mm_arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks;
+    arena_chunk_t *rest = NULL;
+    if (chunk != NULL) {
+        rest = chunk->next;
+        chunk->next = NULL;
+        arena->bump = (char *)(chunk + 1);
+    }
+    if (rest != NULL || arena->big != NULL) {
+        heap_lock_acquire();
+        arena_chunks_free(rest);
+        arena_chunks_free(arena->big);
+        pthread_mutex_unlock(&heap_lock);
+        arena->big = NULL;
+    }
+}
+
+/*
+ * frees everything allocated from an arena, and the arena itself
+ * arguments: arena: the arena, or NULL
+ * returns: nothing
+ */
+void mm_arena_destroy(mm_arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+    heap_lock_acquire();
+    arena_chunks_free(arena->chunks);
+    arena_chunks_free(arena->big);
+    pthread_mutex_unlock(&heap_lock);
+    mm_free(arena);
+}
+
+/*
+ * creates an empty pool of objects of one size. A pool lives in the heap,
+ * so mm_init ends it along with everything else; it must not be used by
+ * two threads at once, though different pools may be
+ * arguments: obj_size: the size of every object
+ *            align: what objects are aligned to, a power of two up to a
+ *                   page; they are always aligned to at least ALIGNMENT
+ * returns: the pool, or NULL if obj_size is 0, align is not allowed, or
+ *          there is no memory left
+ */
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align) {
+    if (align == 0 || (align & (align - 1)) != 0 || align > mem_pagesize()) {
+        fprintf(stderr, "alignment is not a power of two up to a page");
+        return NULL;
+    }
+    // so that a slab's size cannot overflow
+    if (obj_size == 0 || obj_size > SIZE_MAX / (2 * POOL_SLAB_OBJECTS)) {
+        return NULL;
+    }
+    if (align < ALIGNMENT) {
+        align = ALIGNMENT;
+    }
+    mm_pool_t *pool = mm_malloc(sizeof(mm_pool_t));
+    if (pool != NULL) {
+        pool->free = NULL;
+        pool->bump = NULL;
+        pool->limit = NULL;
+        pool->obj_size = (obj_size + align - 1) & ~(align - 1);
+        pool->align = align;
+        pool->slabs = NULL;
+#ifdef MM_POOL_STATS
+        memset(&pool->stats, 0, sizeof(pool->stats));
+#endif
+    }
+    return pool;
+}
+
+/*
+ * takes a new slab for a pool from the heap, once the free stack and the
+ * newest slab have run out
+ * arguments: pool: the pool
+ * returns: the slab's first object, or NULL if there is no memory left
+ */
+static void *pool_grow(mm_pool_t *pool) {
+    size_t size = POOL_SLAB_OBJECTS * pool->obj_size + pool->align;
+    if (size < POOL_SLAB_SIZE) {
+        size = POOL_SLAB_SIZE;
+    }
+    heap_lock_acquire();
+    void **slab = size - WORD_SIZE >= MMAP_THRESHOLD
+                      ? mapped_malloc(size - WORD_SIZE, ALIGNMENT)
+                      : block_malloc(size - WORD_SIZE);
+    pthread_mutex_unlock(&heap_lock);
+    if (slab == NULL) {
+        return NULL;
+    }
+    *slab = pool->slabs;
+    pool->slabs = slab;
+    // the objects follow the link, and run as far as the block does
+    block_t *slabBlock = payload_to_block(slab);
+    char *first =
+        (char *)(((uintptr_t)(slab + 1) + pool->align - 1) & ~(pool->align - 1));
+    size_t count =
+        (size_t)((char *)slabBlock + block_size(slabBlock) - first) /
+        pool->obj_size;
+    pool->limit = first + count * pool->obj_size;
+    pool->bump = first + pool->obj_size;
+#ifdef MM_POOL_STATS
+    pool->stats.capacity += count;
+    pool->stats.bytes += block_size(slabBlock);
+#endif
+    return first;
+}
+
+/*
+ * allocates an object from a pool: the last one freed, if there is one
+ * arguments: pool: the pool
+ * returns: the object, or NULL if there is no memory left
+ */
+void *mm_pool_alloc(mm_pool_t *pool) {
+    void *obj = pool->free;
+    if (obj != NULL) {
+        pool->free = *(void **)obj;
+    } else if (pool->bump < pool->limit) {
+        obj = pool->bump;
+        pool->bump += pool->obj_size;
+    } else if ((obj = pool_grow(pool)) == NULL) {
+        return NULL;
+    }
+#ifdef MM_POOL_STATS
+    if (++pool->stats.in_use > pool->stats.peak) {
+        pool->stats.peak = pool->stats.in_use;
+    }
+#endif
+    return obj;
+}
+
+/*
+ * gives an object back to the pool it came from
+ * arguments: pool: the pool
+ *            ptr: the object, or NULL
+ * returns: nothing
+ */
+void mm_pool_free(mm_pool_t *pool, void *ptr) {
+    if (ptr != NULL) {
+        *(void **)ptr = pool->free;
+        pool->free = ptr;
+#ifdef MM_POOL_STATS
+        pool->stats.in_use--;
+#endif
+    }
+}
+
+/*
+ * frees a pool's slabs, and so every object still allocated from it, and
+ * the pool itself
+ * arguments: pool: the pool, or NULL
+ * returns: nothing
+ */
+void mm_pool_destroy(mm_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    heap_lock_acquire();
+    for (void **slab = pool->slabs; slab != NULL;) {
+        void **next = *slab;
+        heap_free(NULL, slab);
+        slab = next;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    mm_free(pool);
+}
+
+/*
+ * reports how full a pool is
+ * arguments: pool: the pool
+ *            out: where to store its counts
+ * returns: 0, or -1 if pools were built without MM_POOL_STATS and so do
+ *          not count their objects (out is then left alone)
+ */
+int mm_pool_get_stats(mm_pool_t *pool, mm_pool_stats_t *out) {
+#ifdef MM_POOL_STATS
+    *out = pool->stats;
+    return 0;
+#else
+    (void)pool;
+    (void)out;
+    return -1;
+#endif
 }
@@ -1,39 +1,114 @@
-#ifndef MM_H_
-#define MM_H_
-
-#include <stdio.h>
-
-int mm_init(void);
-void *mm_malloc(size_t size);
-void mm_free(void *ptr);
-void *mm_realloc(void *ptr, size_t size);
-
-// Defines alignment to 8 bytes.
-#define ALIGNMENT 8
-// Size of a memory address, which in this case is 8 bytes
-// in a 64-bit system.
-#define WORD_SIZE (sizeof(size_t))
-// Sum of the sizes of the beginning and end tags of a block.
-// (Each tag's size is WORD_SIZE)
-#define TAGS_SIZE (2 * WORD_SIZE)
-// Minimum size of a block. Your implementation should make
-// sure no allocated or free block has a size of less than
-// this constant.
-#define MINBLOCKSIZE (3 * WORD_SIZE)
-
-typedef struct block {
-    size_t size;
-    // size is assumed to be a multiple of 8. The least-significant bit is
-    // overloaded:
-    //     if 0 the block is free
-    //     if 1 the block is allocated
-    int payload[];
-    // the actual size of payload is given in the size field
-    // for free blocks:
-    //     payload[0] is the block's flink (the offset of the next block in the
-    //     free list from the prologue); payload[1] is the block's blink (the
-    //     offset of the previous block in the free list from the prologue)
-    // there is a copy of the size field at the end of the block
-} block_t;
-
-#endif  // MM_H_
+#ifndef MM_H_
+#define MM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+int mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+void mm_free_batch(void **ptrs, size_t n);
+void mm_free_sized(void *ptr, size_t size);
+size_t mm_usable_size(void *ptr);
+size_t mm_expand(void *ptr, size_t min, size_t max);
+int mm_cache_mode(void);
+
+// An arena allocates by bumping a pointer and frees everything at once (see
+// mm_arena_create)
+typedef struct mm_arena mm_arena_t;
+mm_arena_t *mm_arena_create(void);
+void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+void mm_arena_reset(mm_arena_t *arena);
+void mm_arena_destroy(mm_arena_t *arena);
+
+// A pool allocates objects of one size from slabs taken from the heap (see
+// mm_pool_create)
+typedef struct mm_pool mm_pool_t;
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align);
+void *mm_pool_alloc(mm_pool_t *pool);
+void mm_pool_free(mm_pool_t *pool, void *ptr);
+void mm_pool_destroy(mm_pool_t *pool);
+
+// How full a pool is (kept only when built with -D MM_POOL_STATS)
+typedef struct mm_pool_stats {
+    size_t in_use;    // objects allocated and not freed
+    size_t peak;      // the most objects in use at once
+    size_t capacity;  // objects the pool's slabs hold
+    size_t bytes;     // heap bytes the slabs take up
+} mm_pool_stats_t;
+int mm_pool_get_stats(mm_pool_t *pool, mm_pool_stats_t *out);
+
+// Counters the allocator keeps for the current heap (reset by mm_init)
+typedef struct mm_stats {
+    unsigned long splits;          // free blocks split to serve a request
+    unsigned long coalesces;       // free blocks merged with a neighbour
+    unsigned long fastbin_hits;    // requests served from a fast bin
+    unsigned long consolidations;  // passes that emptied the fast bins
+    unsigned long trims;           // times the heap was shrunk
+    unsigned long purges;          // free blocks whose pages were purged
+    unsigned long sbrks;           // times the heap was grown with mem_sbrk
+    unsigned long realloc_copied;  // bytes mm_realloc copied to move blocks
+    unsigned long calloc_skipped;  // bytes mm_calloc knew were zero already
+} mm_stats_t;
+void mm_get_stats(mm_stats_t *stats);
+
+// What small requests go through before the shared, locked heap (see
+// mm_cache_mode)
+#define MM_CACHE_NONE 0    // nothing: every call takes the heap lock
+#define MM_CACHE_THREAD 1  // a cache per thread
+#define MM_CACHE_CPU 2     // a cache per CPU, updated with restartable sequences
+
+// Defines alignment to 8 bytes.
+#define ALIGNMENT 8
+// Size of a memory address, which in this case is 8 bytes
+// in a 64-bit system.
+#define WORD_SIZE (sizeof(size_t))
+// Sum of the sizes of the beginning and end tags of a free block.
+// (Each tag's size is WORD_SIZE.) Allocated blocks only have the
+// beginning tag.
+#define TAGS_SIZE (2 * WORD_SIZE)
+// Minimum size of a block. Your implementation should make
+// sure no allocated or free block has a size of less than
+// this constant. A free block needs its header, two 64-bit links
+// and its end tag.
+#define MINBLOCKSIZE (4 * WORD_SIZE)
+
+// Flags kept in the low bits of a block's size (sizes are multiples of
+// ALIGNMENT, so these bits are otherwise always 0)
+#define BLOCK_ALLOCATED 1       // the block itself is allocated
+#define BLOCK_PREV_ALLOCATED 2  // the block just before it is allocated
+#define BLOCK_MAPPED 4          // the block has a mapping of its own
+#define BLOCK_FLAGS (ALIGNMENT - 1)
+
+typedef struct block {
+    size_t size;
+    // size is assumed to be a multiple of 8. The three least-significant
+    // bits are overloaded:
+    //     bit 0 (BLOCK_ALLOCATED) is 1 if the block is allocated, 0 if free
+    //     bit 1 (BLOCK_PREV_ALLOCATED) is 1 if the block before it is
+    //     allocated, 0 if it is free
+    //     bit 2 (BLOCK_MAPPED) is 1 if the block lies outside the heap in a
+    //     mapping of its own, which ends where the block does and starts
+    //     less than a page before it (at the block itself unless it was
+    //     aligned by mm_memalign)
+    size_t payload[];
+    // the actual size of payload is given in the size field
+    // for free blocks:
+    //     payload[0] is the block's flink (the byte offset of the next block
+    //     in the free list from the prologue); payload[1] is the block's blink
+    //     (the byte offset of the previous block in the free list from the
+    //     prologue). The offsets are 64-bit, so the heap can be as large as
+    //     the address space allows
+    //     there is a copy of the size field at the end of the block, so the
+    //     next block can find the start of this one when coalescing
+    // allocated blocks have no such copy: their payload runs to the end of
+    // the block, and the next block knows they are allocated from its own
+    // BLOCK_PREV_ALLOCATED bit
+} block_t;
+
+#endif  // MM_H_
@@ -0,0 +1,335 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "memlib.h"
+#include "mm.h"
+
+// Multi-threaded stress benchmark for mm.c: runs each workload with 1, 2,
+// 4, ... up to max_threads threads sharing one heap and reports the total
+// throughput and how big the heap grew, so the build with per-thread caches
+// (mmbench) can be compared with the one with per-CPU caches
+// (mmbench-percpu) and the one that takes the heap lock on every call
+// (mmbench-locked).
+#define USAGE                                                              \
+    "./mmbench [-t max_threads] [-n ops_per_thread] <all | "              \
+    "names of workloads to run>"                                          \
+    "\n   Ex. \"./mmbench all\" runs every workload"                        \
+    "\n   Ex. \"./mmbench -t 16 pairs\" runs the pairs workload on 1 to 16 " \
+    "threads"                                                             \
+    "\n   Possible workloads: 'pairs', 'window', 'mixed', 'pipeline', "    \
+    "'nodes', 'pool'"
+
+// number of blocks each thread keeps live in the window workloads
+#define WINDOW 64
+
+// capacity of each pipeline ring
+#define RING_SIZE 256
+
+// number of nodes each thread keeps live in the node workloads, and the
+// sizes of their two kinds: a tree node, which mm_malloc serves from a run,
+// and a connection object, which gets a heap block
+#define NODES 4096
+#define TREE_NODE_SIZE 48
+#define CONN_SIZE 160
+
+// A single-producer, single-consumer ring of blocks handed from one thread
+// to the next in the pipeline workload
+typedef struct ring {
+    unsigned char *blocks[RING_SIZE];
+    size_t sizes[RING_SIZE];
+    unsigned long head;  // next slot the consumer reads
+    unsigned long tail;  // next slot the producer writes
+} ring_t;
+
+typedef struct bench_arg {
+    void (*func)(struct bench_arg *);
+    unsigned int seed;
+    long ops;
+    long errors;
+    ring_t *out;  // pipeline: ring this thread fills
+    ring_t *in;   // pipeline: ring this thread drains
+} bench_arg_t;
+
+// fills a block with a pattern derived from its address and size
+static void fill(unsigned char *p, size_t size) {
+    memset(p, (int)(((uintptr_t)p >> 4) ^ size) & 0xff, size);
+}
+
+// returns 1 if the block still holds the pattern fill() wrote
+static int check(unsigned char *p, size_t size) {
+    unsigned char expected = (unsigned char)((((uintptr_t)p >> 4) ^ size));
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] != expected) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// malloc immediately followed by free, the pattern per-thread caches are for
+static void pairs(bench_arg_t *arg) {
+    for (long i = 0; i < arg->ops; i += 2) {
+        size_t size = 8 + (size_t)(rand_r(&arg->seed) % 120);
+        unsigned char *p = mm_malloc(size);
+        if (p == NULL) {
+            arg->errors++;
+            continue;
+        }
+        fill(p, size);
+        if (!check(p, size)) {
+            arg->errors++;
+        }
+        mm_free(p);
+    }
+}
+
+// frees and reallocates random entries of a window of live blocks with
+// sizes of at most max_size bytes
+static void window(bench_arg_t *arg, size_t max_size) {
+    unsigned char *live[WINDOW] = {NULL};
+    size_t sizes[WINDOW] = {0};
+    for (long i = 0; i < arg->ops; i += 2) {
+        int j = rand_r(&arg->seed) % WINDOW;
+        if (live[j] != NULL) {
+            if (!check(live[j], sizes[j])) {
+                arg->errors++;
+            }
+            mm_free(live[j]);
+        }
+        sizes[j] = 8 + (size_t)(rand_r(&arg->seed) % (max_size - 7));
+        if ((live[j] = mm_malloc(sizes[j])) == NULL) {
+            arg->errors++;
+            continue;
+        }
+        fill(live[j], sizes[j]);
+    }
+    for (int j = 0; j < WINDOW; j++) {
+        mm_free(live[j]);
+    }
+}
+
+// small blocks only, all served from runs
+static void small_window(bench_arg_t *arg) { window(arg, 128); }
+
+// mostly small blocks, some large enough to take the heap lock
+static void mixed_window(bench_arg_t *arg) { window(arg, 512); }
+
+// each thread allocates blocks and passes them to the next thread, which
+// frees them, so almost every free is of a block another thread allocated
+static void pipeline(bench_arg_t *arg) {
+    for (long i = 0; i < arg->ops; i += 2) {
+        size_t size = 8 + (size_t)(rand_r(&arg->seed) % 505);
+        unsigned char *p = mm_malloc(size);
+        if (p == NULL) {
+            arg->errors++;
+            continue;
+        }
+        fill(p, size);
+        ring_t *out = arg->out;
+        unsigned long tail = out->tail;
+        if (tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SIZE) {
+            out->blocks[tail % RING_SIZE] = p;
+            out->sizes[tail % RING_SIZE] = size;
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+        } else {
+            // the next thread is behind; free it here instead
+            mm_free(p);
+        }
+        ring_t *in = arg->in;
+        unsigned long head = in->head;
+        if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+            unsigned char *q = in->blocks[head % RING_SIZE];
+            if (!check(q, in->sizes[head % RING_SIZE])) {
+                arg->errors++;
+            }
+            mm_free(q);
+            __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// replaces random nodes of a set of live ones, half tree nodes and half
+// connection objects, with mm_malloc or, if pooled, from a pool per kind
+static void node_churn(bench_arg_t *arg, int pooled) {
+    static const size_t sizes[2] = {TREE_NODE_SIZE, CONN_SIZE};
+    mm_pool_t *pools[2] = {NULL, NULL};
+    unsigned char *live[NODES] = {NULL};
+    if (pooled && ((pools[0] = mm_pool_create(sizes[0], 8)) == NULL ||
+                   (pools[1] = mm_pool_create(sizes[1], 8)) == NULL)) {
+        arg->errors++;
+        return;
+    }
+    for (long i = 0; i < arg->ops; i += 2) {
+        int j = rand_r(&arg->seed) % NODES;
+        int kind = j & 1;
+        if (live[j] != NULL) {
+            if (!check(live[j], sizes[kind])) {
+                arg->errors++;
+            }
+            if (pooled) {
+                mm_pool_free(pools[kind], live[j]);
+            } else {
+                mm_free(live[j]);
+            }
+        }
+        live[j] = pooled ? mm_pool_alloc(pools[kind]) : mm_malloc(sizes[kind]);
+        if (live[j] == NULL) {
+            arg->errors++;
+            continue;
+        }
+        fill(live[j], sizes[kind]);
+    }
+    if (pooled) {
+        // the pools' slabs go, and every node in them
+        mm_pool_destroy(pools[0]);
+        mm_pool_destroy(pools[1]);
+        return;
+    }
+    for (int j = 0; j < NODES; j++) {
+        mm_free(live[j]);
+    }
+}
+
+static void nodes(bench_arg_t *arg) { node_churn(arg, 0); }
+
+static void pooled_nodes(bench_arg_t *arg) { node_churn(arg, 1); }
+
+static void *bench_thread(void *arg) {
+    bench_arg_t *bench = arg;
+    bench->func(bench);
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * runs one workload on 1, 2, 4, ... max_threads threads, each on a fresh
+ * heap, and prints the throughput for each thread count
+ * arguments: name: the workload's name
+ *            func: the workload
+ *            max_threads: the largest number of threads to run
+ *            ops: malloc and free calls per thread
+ * returns: the number of corrupted or failed allocations seen
+ */
+static long run_workload(const char *name, void (*func)(bench_arg_t *),
+                         int max_threads, long ops) {
+    long errors = 0;
+    printf("%s\n%8s %12s %10s %10s %10s\n", name, "threads", "Mops/sec",
+           "speedup", "heap KB", "peak KB");
+    double base = 0;
+    for (int nthreads = 1; nthreads <= max_threads;
+         nthreads = nthreads < max_threads && nthreads * 2 > max_threads
+                        ? max_threads
+                        : nthreads * 2) {
+        pthread_t threads[nthreads];
+        bench_arg_t args[nthreads];
+        ring_t *rings = calloc(nthreads, sizeof(ring_t));
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mm_init failed\n");
+            exit(1);
+        }
+        double start = now();
+        for (int i = 0; i < nthreads; i++) {
+            args[i].func = func;
+            args[i].seed = (unsigned int)i + 1;
+            args[i].ops = ops;
+            args[i].errors = 0;
+            args[i].out = &rings[i];
+            args[i].in = &rings[(i + nthreads - 1) % nthreads];
+            pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            errors += args[i].errors;
+        }
+        double mops = (double)ops * nthreads / (now() - start) / 1e6;
+        // blocks still in flight between pipeline threads
+        for (int i = 0; i < nthreads; i++) {
+            for (; rings[i].head != rings[i].tail; rings[i].head++) {
+                mm_free(rings[i].blocks[rings[i].head % RING_SIZE]);
+            }
+        }
+        free(rings);
+        if (nthreads == 1) {
+            base = mops;
+        }
+        printf("%8d %12.2f %9.2fx %10zu %10zu\n", nthreads, mops, mops / base,
+               mem_heapsize() / 1024, mem_peak_footprint() / 1024);
+    }
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    long ops = 1000000;
+    int c;
+    while ((c = getopt(argc, argv, "t:n:h")) != -1) {
+        switch (c) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'n':
+                ops = atol(optarg);
+                break;
+            default:
+                printf("USAGE: %s\n", USAGE);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || max_threads < 1 || ops < 2) {
+        printf("USAGE: %s\n", USAGE);
+        return 1;
+    }
+
+    mem_init();
+    mm_init();
+    static const char *modes[] = {"none (locked heap)", "per-thread",
+                                  "per-CPU (rseq)"};
+    printf("cache: %s\n", modes[mm_cache_mode()]);
+    long errors = 0;
+    int all = !strcmp(argv[optind], "all");
+    for (int i = optind; i < argc; i++) {
+        const char *name = argv[i];
+        if (all || !strcmp(name, "pairs")) {
+            errors += run_workload("pairs", pairs, max_threads, ops);
+        }
+        if (all || !strcmp(name, "window")) {
+            errors += run_workload("window", small_window, max_threads, ops);
+        }
+        if (all || !strcmp(name, "mixed")) {
+            errors += run_workload("mixed", mixed_window, max_threads, ops);
+        }
+        if (all || !strcmp(name, "pipeline")) {
+            errors += run_workload("pipeline", pipeline, max_threads, ops);
+        }
+        if (all || !strcmp(name, "nodes")) {
+            errors += run_workload("nodes", nodes, max_threads, ops);
+        }
+        if (all || !strcmp(name, "pool")) {
+            errors += run_workload("pool", pooled_nodes, max_threads, ops);
+        }
+        if (!all && strcmp(name, "pairs") && strcmp(name, "window") &&
+            strcmp(name, "mixed") && strcmp(name, "pipeline") &&
+            strcmp(name, "nodes") && strcmp(name, "pool")) {
+            printf("Unknown workload: %s\n", name);
+        }
+        if (all) {
+            break;
+        }
+    }
+    mem_deinit();
+    if (errors != 0) {
+        printf("%ld corrupted or failed allocations\n", errors);
+        return 1;
+    }
+    return 0;
+}
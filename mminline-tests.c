@@ -4,6 +4,7 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "memlib.h"
 #include "mminline.h"
 #include "mm.h"
 
@@ -13,7 +14,9 @@
     "\n   Ex. \"./inline_tests all\" runs all tests"                        \
     "\n   Ex. \"./inline_tests set_flink set_blink\" runs the set_flink and set_blink " \
     "\n   Ex. \"./inline_tests pull_free_block\" runs the pull_free_block test" \
-    "\n   Possible tests: 'set_flink', 'set_blink', 'pull_free_block'"
+    "\n   Possible tests: 'set_flink', 'set_blink', 'pull_free_block', " \
+    "'size_class', 'prev_allocated', 'free_tree', "                           \
+    "'far_links', 'expand', 'pool_stats', 'free_sized'"
 
 void assert_flink(block_t *expected, block_t *actual, const char *message);
 
@@ -23,15 +26,14 @@ void assert_pull_free_block(block_t *expected, block_t *actual, const char *mess
 
 void print_test_summary();
 
-static block_t *flist_first;
-block_t* prologue;
-block_t* epilogue;
+// prologue and epilogue are mm.c's, which the expand test runs against; the
+// other tests point them at blocks of their own
 
 void set_flink_test() {
     prologue = malloc(16);
     epilogue = malloc(16);
-    block_t *cur_block = (block_t *)malloc(8*2 + 32);
-    block_t *new_flink = (block_t *)malloc(8*2 + 64);
+    block_t *cur_block = (block_t *)calloc(1, 8*2 + 32);
+    block_t *new_flink = (block_t *)calloc(1, 8*2 + 64);
     block_set_size_and_allocated(cur_block, 32, 0);
     block_set_size_and_allocated(new_flink, 64, 0);
     block_set_flink(cur_block, new_flink);
@@ -51,8 +53,8 @@ void set_flink_test() {
 void set_blink_test() {
     prologue = malloc(16);
     epilogue = malloc(16);
-    block_t *cur_block = (block_t *)malloc(8*2 + 32);
-    block_t *new_blink = (block_t *)malloc(8*2 + 64);
+    block_t *cur_block = (block_t *)calloc(1, 8*2 + 32);
+    block_t *new_blink = (block_t *)calloc(1, 8*2 + 64);
     block_set_size_and_allocated(cur_block, 32, 0);
     block_set_size_and_allocated(new_blink, 64, 0);
     block_set_blink(cur_block, new_blink);
@@ -72,12 +74,12 @@ void set_blink_test() {
 void pull_free_block_test() {
     prologue = malloc(16);
     epilogue = malloc(16);
-    block_t *block_one = (block_t *)malloc(8*2 + 32);
-    block_t *block_two = (block_t *)malloc(8*2 + 64);
-    block_t *block_three = (block_t *)malloc(8*2 + 48);
-    flist_first = NULL;
+    block_t *block_one = (block_t *)calloc(1, 8*2 + 32);
+    block_t *block_two = (block_t *)calloc(1, 8*2 + 40);
+    block_t *block_three = (block_t *)calloc(1, 8*2 + 48);
+    flist_reset();
     block_set_size_and_allocated(block_one, 32, 0);
-    block_set_size_and_allocated(block_two, 64, 0);
+    block_set_size_and_allocated(block_two, 40, 0);
     block_set_size_and_allocated(block_three, 48, 0);
     insert_free_block(block_three);
     insert_free_block(block_two);
@@ -85,32 +87,32 @@ void pull_free_block_test() {
     pull_free_block(block_two);
     
     sleep(1);
-    assert(block_one->payload[0] == (int)((char *)block_three - (char *)prologue));
-    assert(block_one->payload[1] == (int)((char *)block_three - (char *)prologue));
-    assert(block_three->payload[0] == (int)((char *)block_one - (char *)prologue));
-    assert(block_three->payload[1] == (int)((char *)block_one - (char *)prologue));
-    assert(flist_first != NULL);
-    assert((block_t *)flist_first == (block_t *) block_one);
+    assert(block_one->payload[0] == (size_t)((char *)block_three - (char *)prologue));
+    assert(block_one->payload[1] == (size_t)((char *)block_three - (char *)prologue));
+    assert(block_three->payload[0] == (size_t)((char *)block_one - (char *)prologue));
+    assert(block_three->payload[1] == (size_t)((char *)block_one - (char *)prologue));
+    assert(flist_first[size_class(32)] != NULL);
+    assert((block_t *)flist_first[size_class(32)] == (block_t *) block_one);
     
     pull_free_block(block_three);
     sleep(1);
-    assert(block_one->payload[0] == (int)((char *)block_one - (char *)prologue));
-    assert(block_one->payload[1] == (int)((char *)block_one - (char *)prologue));
-    assert(flist_first != NULL);
-    assert((block_t *)flist_first == (block_t *) block_one);
+    assert(block_one->payload[0] == (size_t)((char *)block_one - (char *)prologue));
+    assert(block_one->payload[1] == (size_t)((char *)block_one - (char *)prologue));
+    assert(flist_first[size_class(32)] != NULL);
+    assert((block_t *)flist_first[size_class(32)] == (block_t *) block_one);
 
     pull_free_block(block_one);
     sleep(1);
-    assert(flist_first == NULL);
+    assert(flist_first[size_class(32)] == NULL);
 
-    block_t *block_four = (block_t *)malloc(8*2 + 32);
-    block_t *block_five = (block_t *)malloc(8*2 + 64);
-    block_t *block_six = (block_t *)malloc(8*2 + 48);
-    block_t *block_seven = (block_t *)malloc(8*2 + 96);
-    block_set_size_and_allocated(block_four, 32, 0);
-    block_set_size_and_allocated(block_five, 64, 0);
-    block_set_size_and_allocated(block_six, 48, 0);
-    block_set_size_and_allocated(block_seven, 96, 0);
+    block_t *block_four = (block_t *)calloc(1, 8*2 + 64);
+    block_t *block_five = (block_t *)calloc(1, 8*2 + 96);
+    block_t *block_six = (block_t *)calloc(1, 8*2 + 80);
+    block_t *block_seven = (block_t *)calloc(1, 8*2 + 112);
+    block_set_size_and_allocated(block_four, 64, 0);
+    block_set_size_and_allocated(block_five, 96, 0);
+    block_set_size_and_allocated(block_six, 80, 0);
+    block_set_size_and_allocated(block_seven, 112, 0);
 
     insert_free_block(block_seven);
     insert_free_block(block_six);
@@ -120,34 +122,34 @@ void pull_free_block_test() {
     pull_free_block(block_four);
     
     sleep(1);
-    assert(block_five->payload[0] == (int)((char *)block_six - (char *)prologue));
-    assert(block_five->payload[1] == (int)((char *)block_seven - (char *)prologue));
+    assert(block_five->payload[0] == (size_t)((char *)block_six - (char *)prologue));
+    assert(block_five->payload[1] == (size_t)((char *)block_seven - (char *)prologue));
     
-    assert(block_seven->payload[0] == (int)((char *)block_five - (char *)prologue));
-    assert(block_seven->payload[1] == (int)((char *)block_six - (char *)prologue));
-    assert(flist_first != NULL);
-    assert((block_t *)flist_first == (block_t *) block_five);
+    assert(block_seven->payload[0] == (size_t)((char *)block_five - (char *)prologue));
+    assert(block_seven->payload[1] == (size_t)((char *)block_six - (char *)prologue));
+    assert(flist_first[size_class(64)] != NULL);
+    assert((block_t *)flist_first[size_class(64)] == (block_t *) block_five);
 
     pull_free_block(block_five);
     sleep(1);
-    assert(block_six->payload[1] == (int)((char *)block_seven - (char *)prologue));
-    assert(block_six->payload[0] == (int)((char *)block_seven - (char *)prologue));
+    assert(block_six->payload[1] == (size_t)((char *)block_seven - (char *)prologue));
+    assert(block_six->payload[0] == (size_t)((char *)block_seven - (char *)prologue));
 
-    assert(block_seven->payload[1] == (int)((char *)block_six - (char *)prologue));
-    assert(block_seven->payload[0] == (int)((char *)block_six - (char *)prologue));
-    assert(flist_first != NULL);
-    assert((block_t *)flist_first == (block_t *) block_six);
+    assert(block_seven->payload[1] == (size_t)((char *)block_six - (char *)prologue));
+    assert(block_seven->payload[0] == (size_t)((char *)block_six - (char *)prologue));
+    assert(flist_first[size_class(64)] != NULL);
+    assert((block_t *)flist_first[size_class(64)] == (block_t *) block_six);
 
     pull_free_block(block_six);
     sleep(1);
-    assert(block_seven->payload[1] == (int)((char *)block_seven - (char *)prologue));
-    assert(block_seven->payload[0] == (int)((char *)block_seven - (char *)prologue));
-    assert(flist_first != NULL);
-    assert((block_t *)flist_first == (block_t *) block_seven);
+    assert(block_seven->payload[1] == (size_t)((char *)block_seven - (char *)prologue));
+    assert(block_seven->payload[0] == (size_t)((char *)block_seven - (char *)prologue));
+    assert(flist_first[size_class(64)] != NULL);
+    assert((block_t *)flist_first[size_class(64)] == (block_t *) block_seven);
      
     pull_free_block(block_seven);
     sleep(1);
-    assert(flist_first == NULL);
+    assert(flist_first[size_class(64)] == NULL);
 
     free(prologue);
     free(epilogue);
@@ -160,6 +162,116 @@ void pull_free_block_test() {
     free(block_seven);
 }
 
+void size_class_test() {
+    prologue = malloc(16);
+    epilogue = malloc(16);
+    flist_reset();
+    assert(size_class(24) == 0);
+    assert(size_class(32) == 1);
+    assert(size_class(56) == 1);
+    assert(size_class(64) == 2);
+    assert(size_class((size_t)1 << 40) == NUM_FREE_LISTS - 1);
+
+    block_t *small = (block_t *)calloc(1, 8*2 + 32);
+    block_t *large = (block_t *)calloc(1, 8*2 + 512);
+    block_set_size_and_allocated(small, 32, 0);
+    block_set_size_and_allocated(large, 512, 0);
+    insert_free_block(small);
+    insert_free_block(large);
+    assert(flist_first[size_class(32)] == small);
+    assert(flist_first[size_class(512)] == large);
+    assert(flist_nonempty == (((size_t)1 << size_class(32)) |
+                              ((size_t)1 << size_class(512))));
+
+    pull_free_block(small);
+    assert(flist_first[size_class(32)] == NULL);
+    assert(flist_nonempty == ((size_t)1 << size_class(512)));
+    pull_free_block(large);
+    assert(flist_nonempty == 0);
+
+    free(prologue);
+    free(epilogue);
+    free(small);
+    free(large);
+}
+
+void free_tree_test() {
+    // tree links are offsets from the prologue, so keep everything in one
+    // buffer behind it (plus room for the header that follows the last one)
+    char *heap = calloc(1, 16 + 2048 + 1024 + 4096 + 1024 + 8);
+    prologue = (block_t *)heap;
+    epilogue = malloc(16);
+    flist_reset();
+    block_t *mid = (block_t *)(heap + 16);
+    block_t *small = (block_t *)(heap + 16 + 2048);
+    block_t *large = (block_t *)(heap + 16 + 2048 + 1024);
+    block_t *small2 = (block_t *)(heap + 16 + 2048 + 1024 + 4096);
+    block_set_size_and_allocated(mid, 2048, 0);
+    block_set_size_and_allocated(small, 1024, 0);
+    block_set_size_and_allocated(large, 4096, 0);
+    block_set_size_and_allocated(small2, 1024, 0);
+    insert_free_block(small2);
+    insert_free_block(large);
+    insert_free_block(mid);
+    insert_free_block(small);
+    // large blocks stay off the lists
+    assert(flist_nonempty == 0);
+
+    // best fit, lowest address among equal sizes
+    assert(tree_find(1000) == small);
+    assert(tree_find(1024) == small);
+    assert(tree_find(1032) == mid);
+    assert(tree_find(2056) == large);
+    assert(tree_find(4104) == NULL);
+
+    pull_free_block(small);
+    assert(tree_find(1000) == small2);
+    pull_free_block(large);
+    assert(tree_find(2056) == NULL);
+    assert(tree_find(1032) == mid);
+    pull_free_block(small2);
+    pull_free_block(mid);
+    assert(tree_find(0) == NULL);
+
+    free(epilogue);
+    free(heap);
+}
+
+void prev_allocated_test() {
+    prologue = malloc(16);
+    epilogue = malloc(16);
+    // two neighbouring blocks carved out of one buffer, plus room for the
+    // header of whatever follows them
+    char *heap = calloc(1, 32 + 48 + 8);
+    block_t *first = (block_t *)heap;
+    block_t *second = (block_t *)(heap + 32);
+    block_set_size_and_allocated(first, 32, 1);
+    block_set_size_and_allocated(second, 48, 1);
+
+    // allocated blocks tell their right neighbour, and have no end tag
+    assert(block_prev_allocated(second));
+    assert(block_size(second) == 48);
+    assert(*block_end_tag(first) == 0);
+
+    // freeing writes the end tag and clears the neighbour's bit
+    block_set_allocated(first, 0);
+    assert(!block_prev_allocated(second));
+    assert(block_allocated(second));
+    assert(block_end_size(first) == 32);
+    assert(block_prev_size(second) == 32);
+    assert(block_prev(second) == first);
+
+    // resizing keeps the flags and moves the bit to the new neighbour
+    block_set_allocated(first, 1);
+    block_set_size(first, 24);
+    assert(block_allocated(first));
+    assert(block_prev_allocated((block_t *)(heap + 24)));
+
+    free(prologue);
+    free(epilogue);
+    free(heap);
+}
+
 int total_tests, num_correct, num_incorrect;
 int run_test_in_separate_process(void (*func)(), int num_tests, const char *message) {
     printf("running test: ");
@@ -169,6 +281,153 @@ int run_test_in_separate_process(void (*func)(), int num_tests, const char *mess
     return 0;
 }
 
+void far_links_test() {
+    // the blocks sit more than 4 GB past the prologue, which 32-bit offsets
+    // could not reach
+    epilogue = malloc(16);
+    block_t *cur_block = (block_t *)calloc(1, 8*2 + 32);
+    block_t *far_block = (block_t *)calloc(1, 8*2 + 64);
+    prologue = (block_t *)((char *)cur_block - ((size_t)5 << 30));
+    block_set_size_and_allocated(cur_block, 32, 0);
+    block_set_size_and_allocated(far_block, 64, 0);
+    block_set_flink(cur_block, far_block);
+    block_set_blink(cur_block, far_block);
+
+    assert(block_flink(cur_block) == far_block);
+    assert(block_blink(cur_block) == far_block);
+    assert(cur_block->payload[0] > ((size_t)4 << 30));
+    assert(block_size(cur_block) == 32);
+    free(epilogue);
+    free(cur_block);
+    free(far_block);
+}
+
+void expand_test() {
+    mem_init();
+    mm_init();
+    // three neighbouring heap blocks, too big for slots or fast bins
+    char *a = mm_malloc(600);
+    char *b = mm_malloc(600);
+    char *c = mm_malloc(600);
+    memset(a, 'a', 600);
+    memset(b, 'b', 600);
+    memset(c, 'c', 600);
+    size_t usable = mm_usable_size(b);
+    assert(usable >= 600);
+
+    // big enough already, with an allocated neighbour: nothing changes
+    assert(mm_expand(b, 100, 200) == usable);
+    assert(mm_usable_size(b) == usable);
+    assert(mm_expand(b, 600, 600) == usable);
+    // and it cannot grow into an allocated neighbour
+    assert(mm_expand(b, 1000, 1000) == 0);
+    assert(mm_usable_size(b) == usable);
+    for (int i = 0; i < 600; i++) {
+        assert(a[i] == 'a' && b[i] == 'b' && c[i] == 'c');
+    }
+
+    // once the neighbour is free, it grows into it, up to max
+    mm_free(c);
+    size_t grown = mm_expand(b, 700, 800);
+    assert(grown >= 700 && grown <= 800 + MINBLOCKSIZE);
+    assert(mm_usable_size(b) == grown);
+    for (int i = 0; i < 600; i++) {
+        assert(b[i] == 'b');
+    }
+    memset(b, 'b', grown);
+    assert(mm_expand(NULL, 1, 1) == 0);
+    mm_free(a);
+    mm_free(b);
+    mem_deinit();
+}
+
+void pool_stats_test() {
+    mem_init();
+    mm_init();
+    mm_pool_t *pool = mm_pool_create(24, 8);
+    mm_pool_stats_t st;
+    void *objs[2000];
+    // without MM_POOL_STATS there is nothing to report, and out is untouched
+    memset(&st, 0xff, sizeof(st));
+    if (mm_pool_get_stats(pool, &st) != 0) {
+        assert(st.in_use == (size_t)-1 && st.capacity == (size_t)-1);
+        mm_pool_destroy(pool);
+        mem_deinit();
+        return;
+    }
+    assert(st.in_use == 0 && st.peak == 0 && st.capacity == 0 && st.bytes == 0);
+
+    for (int i = 0; i < 100; i++) {
+        objs[i] = mm_pool_alloc(pool);
+    }
+    assert(mm_pool_get_stats(pool, &st) == 0);
+    assert(st.in_use == 100 && st.peak == 100);
+    // one slab: its objects follow the header and the link word
+    assert(st.capacity == (st.bytes - 2 * WORD_SIZE) / 24);
+    size_t slabCapacity = st.capacity;
+    size_t slabBytes = st.bytes;
+
+    for (int i = 0; i < 40; i++) {
+        mm_pool_free(pool, objs[i]);
+    }
+    for (int i = 0; i < 10; i++) {
+        objs[i] = mm_pool_alloc(pool);
+    }
+    mm_pool_get_stats(pool, &st);
+    assert(st.in_use == 70 && st.peak == 100 && st.capacity == slabCapacity);
+
+    // filling the slab takes a second one
+    size_t n = 70;
+    for (int i = 100; n <= slabCapacity; i++, n++) {
+        objs[i] = mm_pool_alloc(pool);
+    }
+    mm_pool_get_stats(pool, &st);
+    assert(st.in_use == slabCapacity + 1 && st.peak == st.in_use);
+    assert(st.capacity > slabCapacity && st.bytes > slabBytes);
+    mm_pool_free(pool, objs[100]);
+    mm_pool_get_stats(pool, &st);
+    assert(st.in_use == slabCapacity && st.peak == slabCapacity + 1);
+    mm_pool_destroy(pool);
+    mem_deinit();
+}
+
+void free_sized_test() {
+    mem_init();
+    mm_init();
+    // small blocks aligned past ALIGNMENT are heap blocks, not slots, and
+    // mm_free_sized has to see that
+    char *aligned[4];
+    for (int i = 0; i < 4; i++) {
+        aligned[i] = mm_memalign(64, 32);
+        assert(((uintptr_t)aligned[i] & 63) == 0);
+        memset(aligned[i], 'a' + i, 32);
+    }
+    mm_free_sized(aligned[0], 32);
+    mm_free_sized(aligned[2], 32);
+    // slots of the same size must not land on the freed blocks' neighbours
+    char *slots[64];
+    for (int i = 0; i < 64; i++) {
+        slots[i] = mm_malloc(32);
+        memset(slots[i], 's', 32);
+        assert(slots[i] + 32 <= aligned[1] || slots[i] >= aligned[1] + 32);
+        assert(slots[i] + 32 <= aligned[3] || slots[i] >= aligned[3] + 32);
+    }
+    for (int i = 0; i < 32; i++) {
+        assert(aligned[1][i] == 'b' && aligned[3][i] == 'd');
+    }
+    // and slots freed by size come back as slots of their class
+    for (int i = 0; i < 64; i++) {
+        mm_free_sized(slots[i], 32);
+    }
+    char *again = mm_malloc(32);
+    assert(again == slots[63]);
+    mm_free_sized(again, 32);
+    mm_free_sized(aligned[1], 32);
+    mm_free_sized(aligned[3], 32);
+    mm_free_sized(NULL, 32);
+    mem_deinit();
+}
+
 void foreach_test(int num_tests, char const *test_names[],
                   int (*wrapper)(void (*)(), int, const char *)){
     int functions_passed = 0;
@@ -177,6 +436,13 @@ void foreach_test(int num_tests, char const *test_names[],
         functions_passed += wrapper(&set_blink_test,5, "set_blink");
         functions_passed += wrapper(&set_flink_test, 6, "set_flink");
         functions_passed += wrapper(&pull_free_block_test, 4, "pull_free_block");
+        functions_passed += wrapper(&size_class_test, 4, "size_class");
+        functions_passed += wrapper(&prev_allocated_test, 4, "prev_allocated");
+        functions_passed += wrapper(&free_tree_test, 4, "free_tree");
+        functions_passed += wrapper(&far_links_test, 4, "far_links");
+        functions_passed += wrapper(&expand_test, 4, "expand");
+        functions_passed += wrapper(&pool_stats_test, 4, "pool_stats");
+        functions_passed += wrapper(&free_sized_test, 4, "free_sized");
         return;
     }
 
@@ -191,6 +457,20 @@ void foreach_test(int num_tests, char const *test_names[],
             functions_passed += wrapper(&set_flink_test, 6, "set_flink");
         else if (!strcmp(test_name, "pull_free_block"))
             functions_passed += wrapper(&pull_free_block_test, 4, "pull_free_block");
+        else if (!strcmp(test_name, "size_class"))
+            functions_passed += wrapper(&size_class_test, 4, "size_class");
+        else if (!strcmp(test_name, "prev_allocated"))
+            functions_passed += wrapper(&prev_allocated_test, 4, "prev_allocated");
+        else if (!strcmp(test_name, "free_tree"))
+            functions_passed += wrapper(&free_tree_test, 4, "free_tree");
+        else if (!strcmp(test_name, "far_links"))
+            functions_passed += wrapper(&far_links_test, 4, "far_links");
+        else if (!strcmp(test_name, "expand"))
+            functions_passed += wrapper(&expand_test, 4, "expand");
+        else if (!strcmp(test_name, "pool_stats"))
+            functions_passed += wrapper(&pool_stats_test, 4, "pool_stats");
+        else if (!strcmp(test_name, "free_sized"))
+            functions_passed += wrapper(&free_sized_test, 4, "free_sized");
         else if (sscanf(test_name, "%d", &dummy) != 1)
             printf("Unknown test: %s\n", test_name);
     }
@@ -5,90 +5,170 @@
 // This file defines inline functions to manipulate blocks and the free list
 // NOTE: to be included only in mm.c
 
-static block_t *flist_first;  // head of circular, doubly linked free list
+#ifdef MM_TLSF
+// TLSF-style two-level index. The first level splits block sizes into
+// power-of-two ranges and the second level splits each range into
+// TLSF_SL_COUNT equal pieces; every (first, second) pair is its own free
+// list. Blocks smaller than 2^TLSF_FL_SHIFT all share first level 0, which
+// is split linearly in ALIGNMENT steps.
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_FL_SHIFT (TLSF_SL_SHIFT + 3)
+#define TLSF_FL_COUNT 42
+#undef NUM_FREE_LISTS
+#define NUM_FREE_LISTS (TLSF_FL_COUNT * TLSF_SL_COUNT)
+#else
+// Number of segregated free lists. Free blocks are binned by size class (see
+// size_class below) so that mm_malloc only has to look at lists whose blocks
+// can satisfy a request. Building with -D NUM_FREE_LISTS=1 gives back the
+// original single first-fit list.
+#ifndef NUM_FREE_LISTS
+#define NUM_FREE_LISTS 16
+#endif
+// Free blocks of at least TREE_MIN_SIZE bytes are not kept on the lists but
+// in a splay tree ordered by (size, address), so large requests get the best
+// fit in O(log n) amortized instead of the first fit a list walk finds.
+// Building with -D MM_NO_TREE keeps every block on the lists.
+#if NUM_FREE_LISTS > 1 && !defined(MM_NO_TREE)
+#define MM_FTREE
+#ifndef TREE_MIN_SIZE
+#define TREE_MIN_SIZE 1024
+#endif
+#endif
+#endif
+
+// heads of the circular, doubly linked free lists, one per size class
+static block_t *flist_first[NUM_FREE_LISTS];
+// bit i is set iff flist_first[i] is non-empty (under MM_TLSF, bit i is set
+// iff some list with first level i is non-empty)
+static size_t flist_nonempty;
+#ifdef MM_FTREE
+// root of the splay tree of large free blocks
+static block_t *ftree_root;
+#endif
+#ifdef MM_TLSF
+// bit j of flist_sl_nonempty[i] is set iff list (i, j) is non-empty
+static size_t flist_sl_nonempty[TLSF_FL_COUNT];
+#endif
 extern block_t *prologue;
 extern block_t *epilogue;
 
 // returns a pointer to the block's end tag (You probably won't need to use this
-// directly)
+// directly). Only free blocks have an end tag.
 static inline size_t *block_end_tag(block_t *b) {
     assert(b->size >= (WORD_SIZE * 2));
-    return (size_t *)(&b->payload[2 * ((b->size / WORD_SIZE) - 2)]);
+    return &b->payload[(b->size / WORD_SIZE) - 2];
 }
 
 // returns 1 if block is allocated, 0 otherwise
 // In other words, returns 1 if the right-most bit in b->size is set, 0
 // otherwise
-static inline int block_allocated(block_t *b) { return b->size & 1; }
+static inline int block_allocated(block_t *b) {
+    return b->size & BLOCK_ALLOCATED;
+}
+
+// returns 1 if the block has a mapping of its own (see mapped_malloc)
+static inline int block_mapped(block_t *b) {
+    return (b->size & BLOCK_MAPPED) != 0;
+}
 
-// same as the above, but checks the end tag of the block
+// same as the above, but checks the end tag of the block (so it is only
+// meaningful for free blocks)
 // NOTE: since b->size is divided by WORD_SIZE, the 3 right-most bits are
 // truncated (including the 'is-allocated' bit)
 static inline int block_end_allocated(block_t *b) {
-    return *block_end_tag(b) & 1;
+    return *block_end_tag(b) & BLOCK_ALLOCATED;
 }
 
 // returns the size of the entire block
-// NOTE: -2 is 111...1110 in binary, so the '& -2' removes the 'is-allocated'
-// bit from the size
-static inline size_t block_size(block_t *b) { return b->size & -2; }
+// NOTE: -8 is 111...1000 in binary, so the '& -8' removes the flag bits
+// from the size
+static inline size_t block_size(block_t *b) { return b->size & -8; }
 
-// same as the above, but uses the end tag of the block
+// same as the above, but uses the end tag of the block (free blocks only)
 static inline size_t block_end_size(block_t *b) {
-    return *block_end_tag(b) & -2;
+    return *block_end_tag(b) & -8;
+}
+
+// Sets or clears the block's BLOCK_PREV_ALLOCATED bit. Only the header is
+// updated: the copy in a free block's end tag is only ever read for its size.
+static inline void block_set_prev_allocated(block_t *b, int prev_allocated) {
+    if (prev_allocated) {
+        b->size |= BLOCK_PREV_ALLOCATED;
+    } else {
+        b->size &= ~(size_t)BLOCK_PREV_ALLOCATED;
+    }
+}
+
+// Tells the block after b whether b is allocated. Nothing follows the
+// epilogue, so it is skipped; when a block grows over the old epilogue,
+// 'epilogue' must already point at the new one before the block is written.
+static inline void block_update_next(block_t *b) {
+    if (b != epilogue) {
+        block_t *next = (block_t *)((char *)b + (b->size & -8));
+        block_set_prev_allocated(next, block_allocated(b));
+    }
 }
 
-// Sets the entire size of the block at both the beginning and the end tags.
-// Preserves the alloc bit (if b is marked allocated or free, it will remain
-// so).
+// Sets the entire size of the block at the beginning tag, and at the end tag
+// too if the block is free. Preserves the flags (if b is marked allocated or
+// free, it will remain so), and updates the BLOCK_PREV_ALLOCATED bit of the
+// block that now follows b.
 // NOTE: size must be a multiple of ALIGNMENT, which means that in binary, its
 // right-most 3 bits must be 0.
 // Thus, we can check if size is a multiple of ALIGNMENT by &-ing it with
 // ALIGNMENT - 1, which is 00..00111 in binary if ALIGNMENT is 8.
 static inline void block_set_size(block_t *b, size_t size) {
     assert((size & (ALIGNMENT - 1)) == 0);
-    // alloc bit is always 0 to start with if the above assert passes
-    size |= block_allocated(b);
-    b->size = size;
-    *block_end_tag(b) = size;
+    b->size = size | (b->size & BLOCK_FLAGS);
+    if (!block_allocated(b)) {
+        *block_end_tag(b) = b->size;
+    }
+    block_update_next(b);
 }
 
-// Sets the allocated flags of the block, at both the beginning and the end
-// tags.
-// NOTE: -2 is 111...1110 in binary
+// Sets the allocated flag of the block, writes the end tag when the block
+// becomes free, and updates the BLOCK_PREV_ALLOCATED bit of the next block.
 static inline void block_set_allocated(block_t *b, int allocated) {
     assert((allocated == 0) || (allocated == 1));
     if (allocated) {
-        b->size |= 1;
-        *block_end_tag(b) |= 1;
+        b->size |= BLOCK_ALLOCATED;
     } else {
-        b->size &= -2;
-        *block_end_tag(b) &= -2;
+        b->size &= ~(size_t)BLOCK_ALLOCATED;
+        *block_end_tag(b) = b->size;
     }
+    block_update_next(b);
 }
 
-// Sets the entire size of the block and sets the allocated flags of the block,
-// at both the beginning and the end
+// Sets the entire size of the block and sets the allocated flags of the block
+// (the end tag is written only for a free block). b's own
+// BLOCK_PREV_ALLOCATED bit is kept, so a block carved out just after another
+// one must only be written once its left neighbour has been.
 static inline void block_set_size_and_allocated(block_t *b, size_t size,
                                                 int allocated) {
-    block_set_size(b, size);
-    block_set_allocated(b, allocated);
+    assert((size & (ALIGNMENT - 1)) == 0);
+    assert((allocated == 0) || (allocated == 1));
+    b->size = size | (b->size & BLOCK_PREV_ALLOCATED) | (size_t)allocated;
+    if (!allocated) {
+        *block_end_tag(b) = b->size;
+    }
+    block_update_next(b);
 }
 
 // returns 1 if the previous block is allocated, 0 otherwise
 static inline int block_prev_allocated(block_t *b) {
-    size_t *tag = ((size_t *)b) - 1;
-    return *tag & 1;
+    return (b->size & BLOCK_PREV_ALLOCATED) != 0;
 }
 
-// returns the size of the previous block
-// NOTE: -2 is 111...1110 in binary
+// returns the size of the previous block, which must be free (only free
+// blocks have an end tag to read it from)
 static inline size_t block_prev_size(block_t *b) {
+    assert(!block_prev_allocated(b));
     size_t *tag = ((size_t *)b) - 1;
-    return *tag & -2;
+    return *tag & -8;
 }
 
-// returns a pointer to the previous block
+// returns a pointer to the previous block, which must be free
 static inline block_t *block_prev(block_t *b) {
     return (block_t *)((char *)b - block_prev_size(b));
 }
@@ -147,15 +227,286 @@ static inline void block_set_blink(block_t *b, block_t *new_blink) {
     b->payload[1] = ((char *)new_blink - (char *)prologue);
 }
 
-// pull a block from the (circularly doubly linked) free list
+// returns floor(log2(x)) for x > 0
+static inline int log2_floor(size_t x) {
+    return (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(x);
+}
+
+#ifdef MM_TLSF
+// returns the index of the free list that blocks of the given size belong
+// to: first level * TLSF_SL_COUNT + second level
+static inline int size_class(size_t size) {
+    int fl, sl;
+    if (size < ((size_t)1 << TLSF_FL_SHIFT)) {
+        fl = 0;
+        sl = (int)(size / ALIGNMENT);
+    } else {
+        int log = log2_floor(size);
+        fl = log - TLSF_FL_SHIFT + 1;
+        sl = (int)(size >> (log - TLSF_SL_SHIFT)) - TLSF_SL_COUNT;
+        if (fl >= TLSF_FL_COUNT) {
+            fl = TLSF_FL_COUNT - 1;
+            sl = TLSF_SL_COUNT - 1;
+        }
+    }
+    return fl * TLSF_SL_COUNT + sl;
+}
+
+// rounds size up to the next second-level boundary, so that every block in
+// size_class(fit_size(size)) or above is at least size bytes
+static inline size_t fit_size(size_t size) {
+    if (size < ((size_t)1 << TLSF_FL_SHIFT)) {
+        return size;
+    }
+    size_t step = (size_t)1 << (log2_floor(size) - TLSF_SL_SHIFT);
+    return (size + step - 1) & ~(step - 1);
+}
+
+static inline void flist_mark_nonempty(int class) {
+    int fl = class / TLSF_SL_COUNT;
+    flist_sl_nonempty[fl] |= (size_t)1 << (class % TLSF_SL_COUNT);
+    flist_nonempty |= (size_t)1 << fl;
+}
+
+static inline void flist_mark_empty(int class) {
+    int fl = class / TLSF_SL_COUNT;
+    flist_sl_nonempty[fl] &= ~((size_t)1 << (class % TLSF_SL_COUNT));
+    if (flist_sl_nonempty[fl] == 0) {
+        flist_nonempty &= ~((size_t)1 << fl);
+    }
+}
+
+// returns the smallest non-empty list index >= class, or -1 if there is
+// none. Two find-first-set instructions at most, whatever the heap holds.
+static inline int flist_next_nonempty(int class) {
+    int fl = class / TLSF_SL_COUNT;
+    size_t sl_map =
+        flist_sl_nonempty[fl] & (~(size_t)0 << (class % TLSF_SL_COUNT));
+    if (sl_map == 0) {
+        size_t fl_map = flist_nonempty & (~(size_t)1 << fl);
+        if (fl_map == 0) {
+            return -1;
+        }
+        fl = __builtin_ctzl(fl_map);
+        sl_map = flist_sl_nonempty[fl];
+    }
+    return fl * TLSF_SL_COUNT + __builtin_ctzl(sl_map);
+}
+#else
+// returns the index of the free list that blocks of the given size belong
+// to. List i holds blocks whose size is in [2^(i+4), 2^(i+5)), except that
+// list 0 also takes the smallest blocks and the last list takes everything
+// above its lower bound.
+static inline int size_class(size_t size) {
+    size_t units = size >> 4;
+    if (NUM_FREE_LISTS == 1 || units <= 1) {
+        return 0;
+    }
+    int class = log2_floor(units);
+    return class < NUM_FREE_LISTS ? class : NUM_FREE_LISTS - 1;
+}
+
+static inline void flist_mark_nonempty(int class) {
+    flist_nonempty |= (size_t)1 << class;
+}
+
+static inline void flist_mark_empty(int class) {
+    flist_nonempty &= ~((size_t)1 << class);
+}
+
+// returns the smallest non-empty list index >= class, or -1 if there is none
+static inline int flist_next_nonempty(int class) {
+    size_t map = flist_nonempty & (~(size_t)0 << class);
+    return map != 0 ? __builtin_ctzl(map) : -1;
+}
+#endif
+
+#ifdef MM_FTREE
+// A free block in the tree keeps the offsets of its left and right children
+// from the prologue in payload[0] and payload[1], where a block on a list
+// keeps its flink and blink. The prologue is never in the tree, so an offset
+// of 0 means there is no child.
+
+// returns the block's left child, or NULL if it has none
+static inline block_t *tree_left(block_t *b) {
+    assert(!block_allocated(b));
+    return b->payload[0] != 0 ? (block_t *)(b->payload[0] + (char *)prologue)
+                              : NULL;
+}
+
+// returns the block's right child, or NULL if it has none
+static inline block_t *tree_right(block_t *b) {
+    assert(!block_allocated(b));
+    return b->payload[1] != 0 ? (block_t *)(b->payload[1] + (char *)prologue)
+                              : NULL;
+}
+
+// sets the block's left child (NULL for none)
+static inline void tree_set_left(block_t *b, block_t *left) {
+    assert(!block_allocated(b));
+    b->payload[0] = left != NULL ? ((char *)left - (char *)prologue) : 0;
+}
+
+// sets the block's right child (NULL for none)
+static inline void tree_set_right(block_t *b, block_t *right) {
+    assert(!block_allocated(b));
+    b->payload[1] = right != NULL ? ((char *)right - (char *)prologue) : 0;
+}
+
+// compares the key (size, b) with the block 'node': returns a negative
+// number if the key orders before node, 0 if it is node, positive otherwise
+static inline int tree_compare(size_t size, block_t *b, block_t *node) {
+    size_t nodeSize = block_size(node);
+    if (size != nodeSize) {
+        return size < nodeSize ? -1 : 1;
+    }
+    return b < node ? -1 : (b > node);
+}
+
+// top-down splay: brings the block with key (size, b) to the root of the
+// tree rooted at t, or the last block met on its search path if the key is
+// not in the tree, and returns the new root
+static inline block_t *tree_splay(block_t *t, size_t size, block_t *b) {
+    if (t == NULL) {
+        return NULL;
+    }
+    // roots and inner ends of the trees of blocks known to order before
+    // and after the key
+    block_t *leftRoot = NULL, *leftMax = NULL;
+    block_t *rightRoot = NULL, *rightMin = NULL;
+    for (;;) {
+        int cmp = tree_compare(size, b, t);
+        if (cmp < 0) {
+            block_t *child = tree_left(t);
+            if (child == NULL) {
+                break;
+            }
+            if (tree_compare(size, b, child) < 0) {
+                // rotate right
+                tree_set_left(t, tree_right(child));
+                tree_set_right(child, t);
+                t = child;
+                if ((child = tree_left(t)) == NULL) {
+                    break;
+                }
+            }
+            // link t into the tree of blocks after the key
+            if (rightMin == NULL) {
+                rightRoot = t;
+            } else {
+                tree_set_left(rightMin, t);
+            }
+            rightMin = t;
+            t = child;
+        } else if (cmp > 0) {
+            block_t *child = tree_right(t);
+            if (child == NULL) {
+                break;
+            }
+            if (tree_compare(size, b, child) > 0) {
+                // rotate left
+                tree_set_right(t, tree_left(child));
+                tree_set_left(child, t);
+                t = child;
+                if ((child = tree_right(t)) == NULL) {
+                    break;
+                }
+            }
+            // link t into the tree of blocks before the key
+            if (leftMax == NULL) {
+                leftRoot = t;
+            } else {
+                tree_set_right(leftMax, t);
+            }
+            leftMax = t;
+            t = child;
+        } else {
+            break;
+        }
+    }
+    // reassemble: t's subtrees go to the inner ends of the side trees, and
+    // the side trees become t's subtrees
+    if (leftMax != NULL) {
+        tree_set_right(leftMax, tree_left(t));
+        tree_set_left(t, leftRoot);
+    }
+    if (rightMin != NULL) {
+        tree_set_left(rightMin, tree_right(t));
+        tree_set_right(t, rightRoot);
+    }
+    return t;
+}
+
+// inserts a free block into the tree; it becomes the root
+static inline void tree_insert(block_t *fb) {
+    size_t size = block_size(fb);
+    block_t *root = tree_splay(ftree_root, size, fb);
+    if (root == NULL) {
+        tree_set_left(fb, NULL);
+        tree_set_right(fb, NULL);
+    } else if (tree_compare(size, fb, root) < 0) {
+        tree_set_left(fb, tree_left(root));
+        tree_set_right(fb, root);
+        tree_set_left(root, NULL);
+    } else {
+        tree_set_right(fb, tree_right(root));
+        tree_set_left(fb, root);
+        tree_set_right(root, NULL);
+    }
+    ftree_root = fb;
+}
+
+// removes a free block from the tree
+static inline void tree_remove(block_t *fb) {
+    size_t size = block_size(fb);
+    block_t *root = tree_splay(ftree_root, size, fb);
+    assert(root == fb);
+    block_t *left = tree_left(root);
+    if (left == NULL) {
+        ftree_root = tree_right(root);
+    } else {
+        // everything on the left orders before fb, so splaying for fb there
+        // brings up the largest block, which has no right child
+        left = tree_splay(left, size, fb);
+        tree_set_right(left, tree_right(root));
+        ftree_root = left;
+    }
+}
+
+// returns the smallest free block in the tree of at least the given size
+// (the lowest-addressed one among equals), or NULL if there is none. It is
+// splayed to the root when it is pulled.
+static inline block_t *tree_find(size_t size) {
+    block_t *best = NULL;
+    block_t *t = ftree_root;
+    while (t != NULL) {
+        if (block_size(t) >= size) {
+            best = t;
+            t = tree_left(t);
+        } else {
+            t = tree_right(t);
+        }
+    }
+    return best;
+}
+#endif
+
+// pull a block from its (circularly doubly linked) free list
 static inline void pull_free_block(block_t *fb) {
-    // TODO: implement this function!
-    // Hint: consider the case when fb is the only block in the free list
+#ifdef MM_FTREE
+    if (block_size(fb) >= TREE_MIN_SIZE) {
+        tree_remove(fb);
+        return;
+    }
+#endif
+    int class = size_class(block_size(fb));
 
-    // if there is onloy one block in the list, reset flist first
-    if (flist_first == fb && (flist_first = block_flink(fb)) == fb) {
-        // set flist first to null
-        flist_first = NULL;
+    // if there is only one block in the list, reset its head
+    if (flist_first[class] == fb &&
+        (flist_first[class] = block_flink(fb)) == fb) {
+        // set the list head to null and mark the list empty
+        flist_first[class] = NULL;
+        flist_mark_empty(class);
         return;
     } else {
         block_set_flink(block_blink(fb), block_flink(fb));
@@ -163,26 +514,52 @@ static inline void pull_free_block(block_t *fb) {
     }
 }
 
-// insert block into the (circularly doubly linked) free list
+// insert block into the (circularly doubly linked) free list for its size,
+// or into the tree if it is large
 static inline void insert_free_block(block_t *fb) {
     assert(!block_allocated(fb));
-    if (flist_first != NULL) {
-        block_t *last = block_blink(flist_first);
-        // put 'fb' in between 'flist_first' and 'last'
-        block_set_flink(fb, flist_first);
+#ifdef MM_FTREE
+    if (block_size(fb) >= TREE_MIN_SIZE) {
+        tree_insert(fb);
+        return;
+    }
+#endif
+    int class = size_class(block_size(fb));
+    block_t *first = flist_first[class];
+    if (first != NULL) {
+        block_t *last = block_blink(first);
+        // put 'fb' in between 'first' and 'last'
+        block_set_flink(fb, first);
         block_set_blink(fb, last);
-        // update 'last' and 'flist_first' so they point to 'fb'
+        // update 'last' and 'first' so they point to 'fb'
         block_set_flink(last, fb);
-        block_set_blink(flist_first, fb);
+        block_set_blink(first, fb);
     } else {
-        // The free list is empty, so when we insert fb, it will be the
+        // The list is empty, so when we insert fb, it will be the
         // only element in the list.
         // Thus it needs to point to itself from both flink and blink
         // (since the list is circular)
         block_set_flink(fb, fb);
         block_set_blink(fb, fb);
+        flist_mark_nonempty(class);
+    }
+    flist_first[class] = fb;
+}
+
+// resets every free list to empty
+static inline void flist_reset(void) {
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        flist_first[i] = NULL;
+    }
+    flist_nonempty = 0;
+#ifdef MM_FTREE
+    ftree_root = NULL;
+#endif
+#ifdef MM_TLSF
+    for (int i = 0; i < TLSF_FL_COUNT; i++) {
+        flist_sl_nonempty[i] = 0;
     }
-    flist_first = fb;
+#endif
 }
 
 #endif  // MMINLINE_H_